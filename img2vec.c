@@ -24,49 +24,204 @@ emcc img2vec.c -o img2vec.js \
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "stb_image_resize2.h"
 #include "imgp.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-#define ACCURACY "%.2f"
+#define ACCURACY 2 // decimals of SVG coordinates
 
 #include "potracelib.h"
-int img2vec(FILE *fp, uint8_t *s, int w, int h, int r, int g, int b, int flag, int turdsize, double alphamax, double opttolerance)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <sys/stat.h>
+#include <dirent.h>
+#include <glob.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdarg.h>
+#include <float.h>
+
+// reverse the bit order of a word, so that pixel x lands on bm_mask(x)
+static inline potrace_word bm_reverse(potrace_word v)
 {
-    potrace_bitmap_t *bm = bm_new(w, h);
-    if (!bm) {
-        fprintf(stderr, "Error allocating bitmap: %s\n", strerror(errno));
-        return 1;
-    }
+    potrace_word m = BM_ALLBITS / 3; // 0x55..
+    v = ((v >> 1) & m) | ((v & m) << 1);
+    m = BM_ALLBITS / 5; // 0x33..
+    v = ((v >> 2) & m) | ((v & m) << 2);
+    m = BM_ALLBITS / 17; // 0x0f..
+    v = ((v >> 4) & m) | ((v & m) << 4);
+    return BM_WORDBITS == 64 ? __builtin_bswap64(v) : __builtin_bswap32(v);
+}
 
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            int n = ((h - y - 1) * w + x) * 3; // Y座標反転
-            int c = (s[n] == r && s[n + 1] == g && s[n + 2] == b) ? 255 : 0;
-            BM_PUT(bm, x, y, c);
+// pack the pixels of the 8bit row s equal to c into scanline p, a whole word per store
+void bm_pack(potrace_word *p, uint8_t *s, int w, uint8_t c)
+{
+    int x = 0;
+#ifdef __SSE2__
+    __m128i k = _mm_set1_epi8(c);
+    for (; x + BM_WORDBITS <= w; x += BM_WORDBITS) {
+        potrace_word v = 0;
+        for (int i=0; i<BM_WORDBITS; i+=16) {
+            __m128i a = _mm_loadu_si128((__m128i*)(s + x + i));
+            v |= (potrace_word)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, k)) << i;
+        }
+        *p++ = bm_reverse(v);
+    }
+#endif
+    while (x < w) { // also the partial last word, excess bits are left 0
+        potrace_word v = 0;
+        int n = w - x < BM_WORDBITS ? w - x : BM_WORDBITS;
+        for (int i=0; i<n; i++) {
+            v |= (potrace_word)(s[x + i] == c) << (BM_WORDBITS - 1 - i);
         }
+        *p++ = v;
+        x += n;
     }
+}
+
+/* palette layer: color, number of pixels and bounding box of those pixels */
+typedef struct {
+    int r, g, b, count;
+    int x0, y0, x1, y1;
+} layer_t;
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// stages timed by -stats; dilate to emit are summed over the layers
+enum { ST_DECODE, ST_RESIZE, ST_POSTERIZE, ST_KMEANS, ST_FILTER, ST_SCALE, ST_QUANT, ST_LABEL,
+       ST_DILATE, ST_EXTRACT, ST_DECOMPOSE, ST_OPTIMIZE, ST_EMIT, ST_WRITE, ST_TOTAL, ST_N };
+static const char *stage_name[ST_N] = { "decode", "resize", "posterize", "kmeans", "filter", "scale", "quantize", "label",
+       "dilate", "extract", "decompose", "optimize", "emit", "write", "total" };
 
+typedef struct {
+    int color, pixels;  // 0xrrggbb and its pixel count
+    int bw, bh;         // traced bitmap, 0 when the layer is skipped
+    int paths, segments;
+    int optwindow_hits; // curve optimization searches cut by -optwindow
+    size_t bytes;
+    double t[ST_N];
+} layer_stat;
+
+typedef struct {
+    int w, h;           // size of the traced image
+    int n_layer;        // palette is layer[1..n_layer-1]
+    int paths, segments;
+    long long optwindow_hits;
+    long long bitmap;   // pixels of all traced bitmaps
+    long long bytes;    // size of the output file
+    double t[ST_N];     // wall time of each stage in seconds
+    layer_stat *layer;
+} img2vec_stat;
+
+// growable output buffer, each layer is written to its own and copied to the file in one go
+typedef struct {
+    char *s;
+    size_t n, size;
+} strbuf;
+
+static inline char *sb_reserve(strbuf *b, size_t n)
+{
+    if (b->n + n > b->size) {
+        b->size = (b->n + n) * 2 > 65536 ? (b->n + n) * 2 : 65536;
+        b->s = realloc(b->s, b->size);
+    }
+    return b->s + b->n;
+}
+
+static inline void sb_puts(strbuf *b, const char *s)
+{
+    size_t n = strlen(s);
+    memcpy(sb_reserve(b, n), s, n);
+    b->n += n;
+}
+
+static void sb_printf(strbuf *b, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(0, 0, fmt, ap);
+    va_end(ap);
+    va_start(ap, fmt);
+    vsnprintf(sb_reserve(b, n+1), n+1, fmt, ap);
+    va_end(ap);
+    b->n += n;
+}
+
+// v with prec decimals, the same text as printf("%.*f", prec, v). The value is scaled and
+// rounded in integers; when it is too large or too close to a rounding tie to be sure
+// of the digit, printf itself is used.
+static void sb_fixed(strbuf *b, double v, int prec)
+{
+    static const double p10[] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+    double t = fabs(v) * p10[prec];
+    double f = floor(t);
+    if (!(t < 1e11) || fabs(t - f - .5) < 1e-4) {
+        sb_printf(b, "%.*f", prec, v);
+        return;
+    }
+    uint64_t k = f + (t - f > .5);
+    char tmp[32], *e = tmp + sizeof(tmp), *d = e;
+    for (int i=0; i<prec; i++, k /= 10) *--d = '0' + k % 10;
+    if (prec) *--d = '.';
+    do *--d = '0' + k % 10; while (k /= 10);
+    if (signbit(v)) *--d = '-';
+    memcpy(sb_reserve(b, e - d), d, e - d);
+    b->n += e - d;
+}
+
+// " x,y" of a point in SVG coordinates
+static inline void sb_point(strbuf *b, char *sep, double x, double y)
+{
+    sb_puts(b, sep);
+    sb_fixed(b, x, ACCURACY);
+    sb_puts(b, ",");
+    sb_fixed(b, y, ACCURACY);
+}
+
+// "x y " of a point in EPS coordinates
+static inline void sb_eps(strbuf *b, double x, double y)
+{
+    sb_fixed(b, x, 6);
+    sb_puts(b, " ");
+    sb_fixed(b, y, 6);
+    sb_puts(b, " ");
+}
+
+static potrace_param_t *trace_param(int turdsize, double alphamax, double opttolerance, int optwindow)
+{
     potrace_param_t *param = potrace_param_default();
     if (!param) {
         fprintf(stderr, "Error allocating parameters: %s\n", strerror(errno));
-        bm_free(bm);
-        return 1;
+        return 0;
     }
     param->turdsize = turdsize;
     param->alphamax = alphamax;
     param->opttolerance = opttolerance;
+    param->optwindow = optwindow;
+    return param;
+}
 
-    potrace_state_t *st = potrace_trace(param, bm);
-    if (!st || st->status != POTRACE_STATUS_OK) {
-        fprintf(stderr, "Error tracing bitmap\n");
-        bm_free(bm);
-        potrace_param_free(param);
-        return 1;
-    }
-    bm_free(bm);
-
+// write the paths of st filled with the color of l, an image of height h
+static void layer_emit(strbuf *fp, potrace_state_t *st, int h, layer_t *l, int flag, layer_stat *ls)
+{
+    double t = now();
+    size_t start = fp->n;
+    int r = l->r, g = l->g, b = l->b;
+    ls->t[ST_DECOMPOSE] = st->time[0];
+    ls->t[ST_OPTIMIZE] = st->time[1];
+    ls->optwindow_hits = st->optwindow_hits;
     potrace_path_t *p = st->plist;
     if (flag & 32) { // SVG
-        fprintf(fp, "<g id=\"%02x%02x%02x\">\n", r, g, b);
-        fprintf(fp, "<path fill=\"#%02x%02x%02x\" fill-rule=\"evenodd\" d=\"", r, g, b);
+        if (flag & 256) sb_puts(fp, "<g>\n"); // tiles repeat the colors
+        else sb_printf(fp, "<g id=\"%02x%02x%02x\">\n", r, g, b);
+        sb_printf(fp, "<path fill=\"#%02x%02x%02x\" fill-rule=\"evenodd\" d=\"", r, g, b);
 
         while (p != NULL) {
             int n = p->curve.n;
@@ -78,27 +233,30 @@ int img2vec(FILE *fp, uint8_t *s, int w, int h, int r, int g, int b, int flag, i
                 continue;
             }
 
-            fprintf(fp, "M" ACCURACY "," ACCURACY, c[n - 1][2].x, h - c[n - 1][2].y);
+            ls->paths++;
+            ls->segments += n;
+            sb_point(fp, "M", c[n - 1][2].x, h - c[n - 1][2].y);
 
             for (int i = 0; i < n; i++) {
                 switch (tag[i]) {
                 case POTRACE_CORNER:
-                    fprintf(fp, " L" ACCURACY "," ACCURACY " L" ACCURACY "," ACCURACY,
-                        c[i][1].x, h - c[i][1].y, c[i][2].x, h - c[i][2].y);
+                    sb_point(fp, " L", c[i][1].x, h - c[i][1].y);
+                    sb_point(fp, " L", c[i][2].x, h - c[i][2].y);
                     break;
                 case POTRACE_CURVETO:
-                    fprintf(fp, " C" ACCURACY "," ACCURACY " " ACCURACY "," ACCURACY " " ACCURACY "," ACCURACY,
-                        c[i][0].x, h - c[i][0].y, c[i][1].x, h - c[i][1].y, c[i][2].x, h - c[i][2].y);
+                    sb_point(fp, " C", c[i][0].x, h - c[i][0].y);
+                    sb_point(fp, " ", c[i][1].x, h - c[i][1].y);
+                    sb_point(fp, " ", c[i][2].x, h - c[i][2].y);
                     break;
                 }
             }
-            fprintf(fp, " Z");
+            sb_puts(fp, " Z");
             p = p->next;
         }
-        fprintf(fp, "\"/>\n");
-        fprintf(fp, "</g>\n");
+        sb_puts(fp, "\"/>\n");
+        sb_puts(fp, "</g>\n");
     } else { // EPS
-        fprintf(fp, "gsave\n");
+        sb_puts(fp, "gsave\n");
         
         while (p != NULL) {
             int n = p->curve.n;
@@ -110,99 +268,487 @@ int img2vec(FILE *fp, uint8_t *s, int w, int h, int r, int g, int b, int flag, i
                 continue;
             }
             
-            fprintf(fp, "%f %f moveto\n", c[n-1][2].x, c[n-1][2].y);
+            ls->paths++;
+            ls->segments += n;
+            sb_eps(fp, c[n-1][2].x, c[n-1][2].y);
+            sb_puts(fp, "moveto\n");
             for (int i=0; i<n; i++) {
                 switch (tag[i]) {
                 case POTRACE_CORNER:
-                    fprintf(fp, "%f %f lineto\n", c[i][1].x, c[i][1].y);
-                    fprintf(fp, "%f %f lineto\n", c[i][2].x, c[i][2].y);
+                    sb_eps(fp, c[i][1].x, c[i][1].y);
+                    sb_puts(fp, "lineto\n");
+                    sb_eps(fp, c[i][2].x, c[i][2].y);
+                    sb_puts(fp, "lineto\n");
                     break;
                 case POTRACE_CURVETO:
-                    fprintf(fp, "%f %f %f %f %f %f curveto\n",
-                            c[i][0].x, c[i][0].y, c[i][1].x, c[i][1].y, c[i][2].x, c[i][2].y);
+                    sb_eps(fp, c[i][0].x, c[i][0].y);
+                    sb_eps(fp, c[i][1].x, c[i][1].y);
+                    sb_eps(fp, c[i][2].x, c[i][2].y);
+                    sb_puts(fp, "curveto\n");
                     break;
                 }
             }
             p = p->next;
         }
-        fprintf(fp, "%f %f %f setrgbcolor fill\n", r / 255.0, g / 255.0, b / 255.0);
-        fprintf(fp, "grestore\n");
+        sb_printf(fp, "%f %f %f setrgbcolor fill\n", r / 255.0, g / 255.0, b / 255.0);
+        sb_puts(fp, "grestore\n");
+    }
+    ls->bytes = fp->n - start;
+    ls->t[ST_EMIT] = now() - t;
+}
+
+/* trace the pixels of the w*h 8bit map s whose value is c, and fill them with the color
+   of l. Only the bounding box of l is traced, on a bitmap with a one pixel border. */
+int img2vec(strbuf *fp, uint8_t *s, int w, int h, int c, layer_t *l, int flag, int turdsize, double alphamax, double opttolerance, int optwindow, layer_stat *ls)
+{
+    double t = now();
+    int x0 = l->x0 - 1, y0 = l->y0 - 1; // crop origin in the image
+    int bw = l->x1 - l->x0 + 3, bh = l->y1 - l->y0 + 3;
+    if (l->x1 < l->x0 || l->y1 < l->y0) bw = bh = 2; // empty layer
+    potrace_bitmap_t *bm = bm_new(bw, bh);
+    if (!bm) {
+        fprintf(stderr, "Error allocating bitmap: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // pixels just outside the bounding box are never c, so rows are packed border included
+    uint8_t *row = 0;
+    if (x0 < 0 || x0 + bw > w) {
+        row = malloc(bw);
+        memset(row, (uint8_t)~c, bw);
+    }
+    for (int y = 1; y < bh - 1; y++) {
+        uint8_t *p = s + (y0 + y) * w + l->x0;
+        if (row) {
+            memcpy(row + 1, p, bw - 2);
+            p = row;
+        } else {
+            p--;
+        }
+        bm_pack(bm_scanline(bm, bh - 1 - y), p, bw, c); // Y座標反転
+    }
+    free(row);
+    ls->bw = bw;
+    ls->bh = bh;
+    ls->t[ST_EXTRACT] = now() - t;
+
+    potrace_param_t *param = trace_param(turdsize, alphamax, opttolerance, optwindow);
+    if (!param) {
+        bm_free(bm);
+        return 1;
+    }
+
+    potrace_state_t *st = potrace_trace_at(param, bm, x0, h - y0 - bh); // back to image coordinates
+    if (!st || st->status != POTRACE_STATUS_OK) {
+        fprintf(stderr, "Error tracing bitmap\n");
+        bm_free(bm);
+        potrace_param_free(param);
+        return 1;
     }
+    bm_free(bm);
+    layer_emit(fp, st, h, l, flag, ls);
     
     potrace_state_free(st);
     potrace_param_free(param);
     return 0;
 }
 
-void color_quant(unsigned char *im, int w, int h, int n_colors, char *name, int flag, int turdsize, double alphamax, double opttolerance)
+/* -ml: trace the layers of the w*h label map s that have pixels and are not skipped, all
+   in one scan of s. Returns the states by layer, NULL for the others, or NULL on failure
+   so that the layers are traced one by one instead. */
+static potrace_state_t **trace_labels(uint8_t *s, int w, int h, layer_t *layer, int n_layer, int flag, int turdsize, double alphamax, double opttolerance, int optwindow)
 {
-    int i;
-    unsigned char *pix = im;
-    node_heap heap = { 0, 0, 0 };
+    potrace_state_t **st = calloc(n_layer, sizeof(potrace_state_t *));
+    uint8_t *want = calloc(n_layer, 1);
+    potrace_param_t *param = trace_param(turdsize, alphamax, opttolerance, optwindow);
+    int ok = st && want && param;
+    if (ok) {
+        for (int i=1; i < n_layer; i++) {
+            layer_t *l = &layer[i];
+            want[i] = l->count && !((flag&4) && l->r==255 && l->g==255 && l->b==255);
+        }
+        if (potrace_trace_labels(param, s, w, h, n_layer, want, st)) {
+            fprintf(stderr, "Error tracing label map: %s\n", strerror(errno));
+            for (int i=0; i < n_layer; i++) {
+                if (st[i]) potrace_state_free(st[i]);
+            }
+            ok = 0;
+        }
+    }
+    if (param) potrace_param_free(param);
+    free(want);
+    if (!ok) {
+        free(st);
+        st = 0;
+    }
+    return st;
+}
 
-    oct_node root = node_new(0, 0, 0);
-    for (i=0; i < w * h; i++, pix += 3) {
-        heap_add(&heap, node_insert(root, pix));
+// write layer l of trace_labels() like img2vec() and free its state
+static void label_emit(strbuf *fp, potrace_state_t *st, int h, layer_t *l, int flag, layer_stat *ls)
+{
+    if (st->status == POTRACE_STATUS_OK) {
+        ls->bw = l->x1 - l->x0 + 3; // the bitmap img2vec() would trace
+        ls->bh = l->y1 - l->y0 + 3;
+        layer_emit(fp, st, h, l, flag, ls);
+    } else {
+        fprintf(stderr, "Error tracing bitmap\n");
     }
+    potrace_state_free(st);
+}
 
-    while (heap.n > n_colors + 1) {
-        heap_add(&heap, node_fold(pop_heap(&heap)));
+/* dilate the pixels of label c into the 0/255 mask p, like imgp_dilate (the image border
+   is left 0). Only the bounding box of l is visited; it is grown to cover the result. */
+void layer_dilate(uint8_t *s, int w, int h, int c, layer_t *l, uint8_t *p)
+{
+    l->x0 = l->x0-1 > 1 ? l->x0-1 : 1;
+    l->y0 = l->y0-1 > 1 ? l->y0-1 : 1;
+    l->x1 = l->x1+1 < w-2 ? l->x1+1 : w-2;
+    l->y1 = l->y1+1 < h-2 ? l->y1+1 : h-2;
+    for (int y=l->y0; y<=l->y1; y++) {
+        for (int x=l->x0; x<=l->x1; x++) {
+            uint8_t *q = s + y*w + x;
+            p[y*w + x] = (q[0]==c || q[-w]==c || q[w]==c || q[-1]==c || q[1]==c) ? 255 : 0;
+        }
     }
+}
+
+#define TILE_OVERLAP 8 // pixels traced beyond each side of a tile
+
+// trace im tile by tile into fp. Each tile is labeled with the global palette on a region
+// grown by TILE_OVERLAP pixels, traced like a whole image and clipped to the tile, so the
+// paths of both sides of a seam are traced from the same pixels and meet on it. The label
+// map, bitmaps and output buffers scale with the tile size; the decoded image is still held
+// whole, as is the histogram of the palette. The stats of the tiles are added to ls; returns the
+// number of layers written in any tile.
+static int quant_tiles(FILE *fp, unsigned char *im, int w, int h, oct_lut *lut, layer_t *palette, int n_layer, int tile, int flag, int turdsize, double alphamax, double opttolerance, int optwindow, layer_stat *ls, long long *bitmap, double *t_label)
+{
+    int rs = tile + 2*TILE_OVERLAP;
+    uint8_t *label = malloc((size_t)rs * rs);
+    uint8_t *written = calloc(n_layer, 1);
+    layer_t *layer = malloc(n_layer * sizeof(layer_t));
+    layer_stat *tls = malloc(n_layer * sizeof(layer_stat));
+    strbuf *buf = calloc(n_layer, sizeof(strbuf));
+
+    for (int ty=0, id=0; ty < h; ty += tile) {
+        for (int tx=0; tx < w; tx += tile, id++) {
+            double t = now();
+            int x0 = tx > TILE_OVERLAP ? tx - TILE_OVERLAP : 0;
+            int y0 = ty > TILE_OVERLAP ? ty - TILE_OVERLAP : 0;
+            int x1 = tx + tile + TILE_OVERLAP < w ? tx + tile + TILE_OVERLAP : w;
+            int y1 = ty + tile + TILE_OVERLAP < h ? ty + tile + TILE_OVERLAP : h;
+            int rw = x1 - x0, rh = y1 - y0;
+            int cw = tx + tile < w ? tile : w - tx, ch = ty + tile < h ? tile : h - ty;
+
+            #pragma omp parallel for schedule(static)
+            for (int y=0; y<rh; y++) {
+                unsigned char *pix = im + ((size_t)(y0 + y)*w + x0)*3;
+                for (int x=0; x<rw; x++, pix += 3) label[y*rw + x] = oct_lut_index(lut, pix);
+            }
+            for (int i=1; i < n_layer; i++) {
+                layer[i] = palette[i];
+                layer[i].count = 0;
+                layer[i].x0 = rw;
+                layer[i].y0 = rh;
+                layer[i].x1 = layer[i].y1 = -1;
+            }
+            uint8_t *lp = label;
+            for (int y=0; y<rh; y++) {
+                for (int x=0; x<rw; x++) {
+                    layer_t *l = &layer[*lp++];
+                    l->count++;
+                    if (x < l->x0) l->x0 = x;
+                    if (x > l->x1) l->x1 = x;
+                    if (y < l->y0) l->y0 = y;
+                    l->y1 = y;
+                }
+            }
+            *t_label += now() - t;
+
+            memset(tls, 0, n_layer * sizeof(layer_stat));
+            potrace_state_t **lst = 0;
+            if ((flag&512) && !(flag&2)) lst = trace_labels(label, rw, rh, layer, n_layer, flag, turdsize, alphamax, opttolerance, optwindow);
+            #pragma omp parallel for schedule(dynamic)
+            for (int i=1; i < n_layer; i++) {
+                layer_t *l = &layer[i];
+                buf[i].n = 0;
+                if (!l->count) continue;
+                if ((flag&4) && l->r==255 && l->g==255 && l->b==255) continue;
+                if (flag&2) {
+                    layer_t dl = *l;
+                    double td = now();
+                    uint8_t *mask = calloc(rw, rh);
+                    layer_dilate(label, rw, rh, i, &dl, mask);
+                    tls[i].t[ST_DILATE] = now() - td;
+                    img2vec(&buf[i], mask, rw, rh, 255, &dl, flag, turdsize, alphamax, opttolerance, optwindow, &tls[i]);
+                    free(mask);
+                } else if (lst) {
+                    if (lst[i]) label_emit(&buf[i], lst[i], rh, l, flag, &tls[i]);
+                } else {
+                    img2vec(&buf[i], label, rw, rh, i, l, flag, turdsize, alphamax, opttolerance, optwindow, &tls[i]);
+                }
+            }
+
+            // the region is traced in its own coordinates, the tile is clipped in the image's
+            if (flag&32) {
+                fprintf(fp, "<clipPath id=\"tile%d\"><rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\"/></clipPath>\n", id, tx, ty, cw, ch);
+                fprintf(fp, "<g clip-path=\"url(#tile%d)\"><g transform=\"translate(%d %d)\">\n", id, x0, y0);
+            } else {
+                fprintf(fp, "gsave %d %d %d %d rectclip %d %d translate\n", tx, h - ty - ch, cw, ch, x0, h - y1);
+            }
+            for (int i=1; i < n_layer; i++) {
+                if (!buf[i].n) continue;
+                fwrite(buf[i].s, 1, buf[i].n, fp);
+                written[i] = 1;
+                ls[i].paths += tls[i].paths;
+                ls[i].segments += tls[i].segments;
+                ls[i].optwindow_hits += tls[i].optwindow_hits;
+                ls[i].bytes += tls[i].bytes;
+                for (int k=0; k<ST_N; k++) ls[i].t[k] += tls[i].t[k];
+                if (tls[i].bw * tls[i].bh > ls[i].bw * ls[i].bh) { // largest tile bitmap
+                    ls[i].bw = tls[i].bw;
+                    ls[i].bh = tls[i].bh;
+                }
+                if (!lst) *bitmap += (long long)tls[i].bw * tls[i].bh;
+            }
+            if (lst) *bitmap += (long long)rw * rh;
+            free(lst);
+            fprintf(fp, flag&32 ? "</g></g>\n" : "grestore\n");
+        }
+    }
+
+    int n = 0;
+    for (int i=1; i < n_layer; i++) {
+        n += written[i];
+        free(buf[i].s);
+    }
+    free(buf);
+    free(tls);
+    free(layer);
+    free(written);
+    free(label);
+    return n;
+}
 
-    for (i=1; i < heap.n; i++) {
-        oct_node got = heap.buf[i];
+// trace every palette layer of im into name, returns the number of layers written.
+// With tile > 0, larger images are traced tile by tile (see quant_tiles).
+// q keeps the octree nodes so that it can be reused for the next image. When st is
+// given, it gets the stage times and counters, and the per layer stats in st->layer.
+int color_quant(unsigned char *im, int w, int h, int n_colors, char *name, int flag, int turdsize, double alphamax, double opttolerance, int optwindow, int tile, oct_quant *q, img2vec_stat *st)
+{
+    int i;
+    unsigned char *pix = im;
+    double t = now();
+
+    if (n_colors > 255) n_colors = 255; // palette index is stored in 8bit
+
+    oct_node root = oct_build(q, im, w, h, n_colors);
+    int n_layer = q->heap.n; // palette is layer[1..n_layer-1]
+
+    layer_t *layer = calloc(n_layer, sizeof(layer_t));
+    layer_stat *ls = calloc(n_layer, sizeof(layer_stat));
+    for (i=1; i < n_layer; i++) {
+        oct_node got = q->heap.buf[i];
         double c = got->count;
         got->r = got->r / c + .5;
         got->g = got->g / c + .5;
         got->b = got->b / c + .5;
-        printf("%2d | %3lu %3lu %3lu (%d pixels)\n",
+        if (!(flag&128)) printf("%2d | %3lu %3lu %3lu (%d pixels)\n",
                i, got->r, got->g, got->b, got->count);
+
+        layer[i].r = got->r;
+        layer[i].g = got->g;
+        layer[i].b = got->b;
+        layer[i].x0 = w;
+        layer[i].y0 = h;
+        layer[i].x1 = layer[i].y1 = -1;
+        ls[i].color = got->r << 16 | got->g << 8 | got->b;
+        ls[i].pixels = got->count;
+    }
+    double t_quant = now() - t;
+    t = now();
+
+    // palette index per pixel through a lookup table, then pixel counts and bounding boxes
+    int tiled = tile > 0 && (w > tile || h > tile);
+    if (tiled && (flag&1)) fprintf(stderr, "Warning: -d writes no posterized or layer images with -tile\n");
+    oct_lut *lut = malloc(sizeof(oct_lut));
+    oct_lut_build(lut, root);
+    uint8_t *label = 0;
+    if (!tiled) {
+        label = malloc(w * h);
+        imgp_color_map(lut, im, w, h, label);
     }
 
-    for (i=0, pix = im; i < w * h; i++, pix += 3) {
-        color_replace(root, pix);
+    uint8_t *lp = label;
+    for (int y=0; y<h && label; y++) {
+        for (int x=0; x<w; x++) {
+            layer_t *l = &layer[*lp++];
+            l->count++;
+            if (x < l->x0) l->x0 = x;
+            if (x > l->x1) l->x1 = x;
+            if (y < l->y0) l->y0 = y;
+            l->y1 = y;
+        }
     }
+    double t_label = now() - t;
 
-    if (flag&1) stbi_write_jpg("posterized.jpg", w, h, 3, im, 0);
+    if ((flag&1) && label) { // posterized image for debugging
+        pix = im;
+        for (i=0; i < w * h; i++, pix += 3) {
+            layer_t *l = &layer[label[i]];
+            pix[0] = l->r;
+            pix[1] = l->g;
+            pix[2] = l->b;
+        }
+    }
+
+    if ((flag&1) && label) stbi_write_jpg("posterized.jpg", w, h, 3, im, 0);
     FILE *fp = fopen(name, "w");
+    if (!fp) {
+        oct_lut_free(lut);
+        free(lut);
+        free(label);
+        free(layer);
+        free(ls);
+        return -1;
+    }
     if (!(flag&32)) fprintf(fp, "%%!PS-Adobe-3.0 EPSF-3.0\n");
     if (!(flag&32)) fprintf(fp, "%%%%BoundingBox: 0 0 %d %d\n", w, h);
     if (flag&32) fprintf(fp, "<svg id=\"illust\" xmlns=\"http://www.w3.org/2000/svg\" width=\"%dpx\" height=\"%dpx\" viewBox=\"0 0 %d %d\">\n", w, h, w, h);
     if (flag&32) fprintf(fp, "<!-- Generator: img2vec by Yuichiro Nakada -->");
-    uint8_t *img = malloc(w * h *3*2);
-    for (i=1; i < heap.n; i++) {
-        memset(img, 0, w * h *3);
-        oct_node got = heap.buf[i];
-        int n;
-        for (n=0, pix = im; n < w * h; n++, pix += 3) {
-            if (got->r==pix[0] && got->g==pix[1] && got->b==pix[2]) {
-                img[n*3] = got->r;
-                img[n*3+1] = got->g;
-                img[n*3+2] = got->b;
+    long long bitmap = 0;
+    int n = 0;
+    if (tiled) {
+        n = quant_tiles(fp, im, w, h, lut, layer, n_layer, tile, flag | 256, turdsize, alphamax, opttolerance, optwindow, ls, &bitmap, &t_label);
+        t = now();
+    } else {
+        // with -ml the layers are decomposed together in one scan of the label map first
+        potrace_state_t **lst = 0;
+        if ((flag&512) && !(flag&2)) lst = trace_labels(label, w, h, layer, n_layer, flag, turdsize, alphamax, opttolerance, optwindow);
+
+        // layers are traced in parallel into their own buffers, then written in palette order
+        strbuf *buf = calloc(n_layer, sizeof(strbuf));
+        #pragma omp parallel for schedule(dynamic)
+        for (i=1; i < n_layer; i++) {
+            layer_t *l = &layer[i];
+            if (flag&1) {
+                uint8_t *img = calloc(w * h, 3);
+                for (int n=0; n < w * h; n++) {
+                    if (label[n] != i) continue;
+                    img[n*3] = l->r;
+                    img[n*3+1] = l->g;
+                    img[n*3+2] = l->b;
+                }
+                char str[256];
+                snprintf(str, sizeof(str), "original_d%02d.png", i);
+                stbi_write_png(str, w, h, 3, img, 0);
+                free(img);
+            }
+            if (flag&4) {
+                if (l->r==255 && l->g==255 && l->b==255) continue;
+            }
+            if (flag&2) {
+                layer_t dl = *l;
+                double td = now();
+                uint8_t *mask = calloc(w, h); // only the bounding box is touched
+                layer_dilate(label, w, h, i, &dl, mask);
+                ls[i].t[ST_DILATE] = now() - td;
+                img2vec(&buf[i], mask, w, h, 255, &dl, flag, turdsize, alphamax, opttolerance, optwindow, &ls[i]);
+                free(mask);
+            } else if (lst) {
+                if (lst[i]) label_emit(&buf[i], lst[i], h, l, flag, &ls[i]);
+            } else {
+                img2vec(&buf[i], label, w, h, i, l, flag, turdsize, alphamax, opttolerance, optwindow, &ls[i]);
             }
         }
-        if (flag&1) {
-            char str[256];
-            snprintf(str, sizeof(str), "original_d%02d.png", i);
-            stbi_write_png(str, w, h, 3, img, 0);
-        }
-        if (flag&4) {
-            if (got->r==255 && got->g==255 && got->b==255) continue;
-        }
-        if (flag&2) {
-            imgp_dilate(img, w, h, 3, img+w * h *3);
-            img2vec(fp, img+w * h *3, w, h, got->r, got->g, got->b, flag, turdsize, alphamax, opttolerance);
-        } else {
-            img2vec(fp, img, w, h, got->r, got->g, got->b, flag, turdsize, alphamax, opttolerance);
+        t = now();
+        for (i=1; i < n_layer; i++) {
+            if (buf[i].s) fwrite(buf[i].s, 1, buf[i].n, fp), n++;
+            free(buf[i].s);
+            if (!lst) bitmap += (long long)ls[i].bw * ls[i].bh;
         }
+        if (lst) bitmap = (long long)w * h; // one label map instead of a bitmap per layer
+        free(lst);
+        free(buf);
     }
-    free(img);
+    oct_lut_free(lut);
+    free(lut);
+    free(label);
+    free(layer);
     if (!(flag&32)) fprintf(fp, "%%EOF\n");
     if (flag&32) fprintf(fp, "</svg>\n");
+    long long bytes = ftell(fp);
     fclose(fp);
 
-    node_free();
-    free(heap.buf);
+    if (st) {
+        st->t[ST_QUANT] = t_quant;
+        st->t[ST_LABEL] = t_label;
+        st->t[ST_WRITE] = now() - t;
+        st->n_layer = n_layer;
+        st->bytes = bytes;
+        for (i=1; i < n_layer; i++) {
+            for (int k=ST_DILATE; k<=ST_EMIT; k++) st->t[k] += ls[i].t[k];
+            st->paths += ls[i].paths;
+            st->segments += ls[i].segments;
+            st->optwindow_hits += ls[i].optwindow_hits;
+        }
+        st->bitmap = bitmap;
+        st->layer = ls;
+    } else {
+        free(ls);
+    }
+    return n;
+}
+
+void stat_free(img2vec_stat *st)
+{
+    free(st->layer);
+    st->layer = 0;
+}
+
+// print st as a table, the per layer stages are thread time when layers run in parallel
+void stat_table(FILE *fp, img2vec_stat *st)
+{
+    fprintf(fp, "%dx%d, %d colors, %d paths, %d segments, %lld bitmap pixels, %lld bytes\n",
+            st->w, st->h, st->n_layer > 0 ? st->n_layer-1 : 0, st->paths, st->segments, st->bitmap, st->bytes);
+    if (st->optwindow_hits) fprintf(fp, "optwindow cut %lld curve searches\n", st->optwindow_hits);
+    for (int k=0; k<ST_N; k++) {
+        if (st->t[k] > 0 || k == ST_TOTAL) fprintf(fp, "%-10s %9.3f ms\n", stage_name[k], st->t[k] * 1000);
+    }
+    if (!st->layer) return;
+    fprintf(fp, "layer  color   pixels     bitmap    paths segments     bytes  extract  decomp.  optim.    emit (ms)\n");
+    for (int i=1; i < st->n_layer; i++) {
+        layer_stat *l = &st->layer[i];
+        if (!l->bw) {
+            fprintf(fp, "%5d %06x %8d    skipped\n", i, l->color, l->pixels);
+            continue;
+        }
+        fprintf(fp, "%5d %06x %8d %5dx%-5d %8d %8d %9zu %8.3f %8.3f %8.3f %8.3f\n",
+                i, l->color, l->pixels, l->bw, l->bh, l->paths, l->segments, l->bytes,
+                l->t[ST_EXTRACT] * 1000, l->t[ST_DECOMPOSE] * 1000, l->t[ST_OPTIMIZE] * 1000, l->t[ST_EMIT] * 1000);
+    }
+}
+
+// print st as a JSON object, times in seconds
+void stat_json(FILE *fp, img2vec_stat *st)
+{
+    fprintf(fp, "{\"width\":%d,\"height\":%d,\"colors\":%d,\"paths\":%d,\"segments\":%d,\"optwindow_hits\":%lld,\"bitmap\":%lld,\"bytes\":%lld,\"time\":{",
+            st->w, st->h, st->n_layer > 0 ? st->n_layer-1 : 0, st->paths, st->segments, st->optwindow_hits, st->bitmap, st->bytes);
+    for (int k=0; k<ST_N; k++) fprintf(fp, "%s\"%s\":%.6f", k ? "," : "", stage_name[k], st->t[k]);
+    fprintf(fp, "},\"layer\":[");
+    for (int i=1; st->layer && i < st->n_layer; i++) {
+        layer_stat *l = &st->layer[i];
+        fprintf(fp, "%s{\"color\":\"#%06x\",\"pixels\":%d", i > 1 ? "," : "", l->color, l->pixels);
+        if (l->bw) {
+            fprintf(fp, ",\"bitmap\":[%d,%d],\"paths\":%d,\"segments\":%d,\"optwindow_hits\":%d,\"bytes\":%zu",
+                    l->bw, l->bh, l->paths, l->segments, l->optwindow_hits, l->bytes);
+            for (int k=ST_DILATE; k<=ST_EMIT; k++) fprintf(fp, ",\"%s\":%.6f", stage_name[k], l->t[k]);
+        } else {
+            fprintf(fp, ",\"skipped\":true");
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "]}");
 }
 
 void filter_posterize(unsigned char *img, int width, int height, int levels)
@@ -216,72 +762,324 @@ void filter_posterize(unsigned char *img, int width, int height, int levels)
     }
 }
 
-double dist(unsigned char *img, int i, int j)
+static inline uint32_t xorshift32(uint32_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+// squared distance of color i of the planar colors p (n per plane) to the center c
+static inline float kmeans_d2(float *p, size_t n, size_t i, float *c)
 {
-    double dr = (double)img[i] - (double)img[j];
-    double dg = (double)img[i+1] - (double)img[j+1];
-    double db = (double)img[i+2] - (double)img[j+2];
+    float dr = p[i] - c[0], dg = p[n+i] - c[1], db = p[2*n+i] - c[2];
     return dr*dr + dg*dg + db*db;
 }
 
-void filter_kmeans(unsigned char *img, int width, int height, int k, int iterations)
+static inline float kmeans_cd2(float *a, float *b)
+{
+    float dr = a[0] - b[0], dg = a[1] - b[1], db = a[2] - b[2];
+    return dr*dr + dg*dg + db*db;
+}
+
+// k-means++ seeding on at most 65536 evenly spaced colors weighted by their count, with a
+// fixed xorshift seed so that the result is the same on every run
+static void kmeans_seed(float *p, uint32_t *wt, int n, int k, float *c)
+{
+    int step = n > 65536 ? n / 65536 : 1, m = n / step;
+    float *d = malloc(m * sizeof(float));
+    uint32_t seed = 2463534242u;
+
+    size_t i0 = (size_t)(xorshift32(&seed) % m) * step;
+    for (int t=0; t<3; t++) c[t] = p[t*n + i0];
+    for (int i=0; i<m; i++) d[i] = kmeans_d2(p, n, (size_t)i*step, c);
+
+    for (int j=1; j<k; j++) {
+        double sum = 0;
+        for (int i=0; i<m; i++) sum += (double)d[i] * wt[(size_t)i*step];
+        double r = xorshift32(&seed) / 4294967296.0 * sum;
+        int i = 0;
+        if (sum > 0) {
+            for (; i<m-1 && (r -= (double)d[i] * wt[(size_t)i*step]) >= 0; i++);
+        } else {
+            i = xorshift32(&seed) % m; // fewer distinct colors than k
+        }
+        for (int t=0; t<3; t++) c[j*3+t] = p[t*n + (size_t)i*step];
+        for (i=0; i<m; i++) {
+            float e = kmeans_d2(p, n, (size_t)i*step, c + j*3);
+            if (e < d[i]) d[i] = e;
+        }
+    }
+    free(d);
+}
+
+#define KMEANS_CHUNK 4096 // colors per task of the assignment step
+
+// add color i with weight w to (or, w < 0, remove it from) the sums s[j*4] of center j
+static inline void kmeans_add(double *s, float *p, size_t n, size_t i, int j, double w)
 {
-    int n = width * height;
-    unsigned char *centroids = malloc(k * 3);
-    int *labels = malloc(n * sizeof(int));
+    s[j*4] += w * p[i];
+    s[j*4+1] += w * p[n+i];
+    s[j*4+2] += w * p[2*n+i];
+    s[j*4+3] += w;
+}
 
-    for (int c = 0; c < k; c++) {
-        int idx = (rand() % n) * 3;
-        centroids[c*3+0] = img[idx+0];
-        centroids[c*3+1] = img[idx+1];
-        centroids[c*3+2] = img[idx+2];
+// planar r, g, b rows and the pixel counts of the colors of a histogram
+static float *kmeans_planar(color_hist *hist, uint32_t **wt)
+{
+    int n = hist->n;
+    float *p = malloc((size_t)n * 3 * sizeof(float));
+    *wt = malloc(n * sizeof(uint32_t));
+    for (int i=0; i<n; i++) {
+        uint32_t key = hist->e[i].key;
+        p[i] = key >> 16;
+        p[n+i] = key >> 8 & 255;
+        p[2*n+i] = key & 255;
+        (*wt)[i] = hist->e[i].count;
     }
+    return p;
+}
 
-    for (int it = 0; it < iterations; it++) {
-        for (int p = 0; p < n; p++) {
-            double bestd = 1e12;
-            int bestc = 0;
-            for (int c = 0; c < k; c++) {
-                double dr = (double)img[p*3+0] - (double)centroids[c*3+0];
-                double dg = (double)img[p*3+1] - (double)centroids[c*3+1];
-                double db = (double)img[p*3+2] - (double)centroids[c*3+2];
-                double d = dr*dr + dg*dg + db*db;
-                if (d < bestd) { bestd = d; bestc = c; }
+// k-means of the n planar colors p weighted by wt (Hamerly's algorithm). Every color keeps
+// an upper bound of the distance to its center and a lower bound of the distance to any
+// other center, and is only compared with all centers when the bounds overlap. Those
+// colors are gathered per chunk into planar rows for the SIMD nearest kernel; chunks run
+// in parallel and their sums are joined in thread order. Stops after iterations center
+// updates or when no color changes its cluster. The k centers are left in c (rgb).
+static void kmeans_fit(float *p, uint32_t *wt, int n, int k, int iterations, float *c)
+{
+    int nt = 1;
+#ifdef _OPENMP
+    nt = omp_get_max_threads();
+#endif
+    float *half = malloc(k * sizeof(float));  // half the distance to the nearest other center
+    float *move = malloc(k * sizeof(float));
+    double *sum = calloc(k * 4, sizeof(double)); // r, g, b, count
+    double *part = malloc((size_t)nt * k * 4 * sizeof(double));
+    uint16_t *label = malloc(n * sizeof(uint16_t));
+    float *ub = malloc(n * sizeof(float));
+    float *lb = malloc(n * sizeof(float));
+
+    int r1 = 0;
+    float m1 = 0, m2 = 0; // largest and second largest move, r1 moved most
+    kmeans_seed(p, wt, n, k, c);
+    for (int it=0; ; it++) {
+        int changed = 0;
+        memset(part, 0, (size_t)nt * k * 4 * sizeof(double));
+
+        #pragma omp parallel num_threads(nt)
+        {
+            int id = 0;
+#ifdef _OPENMP
+            id = omp_get_thread_num();
+#endif
+            double *s = part + (size_t)id * k * 4;
+            float *q = malloc(KMEANS_CHUNK * 5 * sizeof(float)); // r, g, b, d1, d2
+            uint16_t *l = malloc(KMEANS_CHUNK * sizeof(uint16_t));
+            int *list = malloc(KMEANS_CHUNK * sizeof(int));
+
+            #pragma omp for schedule(static) reduction(+:changed)
+            for (int i0=0; i0<n; i0+=KMEANS_CHUNK) {
+                int m = n - i0 < KMEANS_CHUNK ? n - i0 : KMEANS_CHUNK;
+                if (!it) { // first assignment: every color against every center
+                    imgp_simd.nearest(p + i0, p + n + i0, p + 2*n + i0, m, c, k, label + i0, ub + i0, lb + i0);
+                    for (int i=i0; i<i0+m; i++) kmeans_add(s, p, n, i, label[i], wt[i]);
+                    continue;
+                }
+                int cnt = 0;
+                for (int i=i0; i<i0+m; i++) {
+                    int a = label[i];
+                    ub[i] += move[a];
+                    lb[i] -= a == r1 ? m2 : m1;
+                    float b = half[a] > lb[i] ? half[a] : lb[i];
+                    if (ub[i] <= b) continue;
+                    ub[i] = sqrtf(kmeans_d2(p, n, i, c + a*3));
+                    if (ub[i] <= b) continue;
+                    q[cnt] = p[i];
+                    q[KMEANS_CHUNK + cnt] = p[n+i];
+                    q[2*KMEANS_CHUNK + cnt] = p[2*n+i];
+                    list[cnt++] = i;
+                }
+                imgp_simd.nearest(q, q + KMEANS_CHUNK, q + 2*KMEANS_CHUNK, cnt, c, k, l, q + 3*KMEANS_CHUNK, q + 4*KMEANS_CHUNK);
+                for (int t=0; t<cnt; t++) {
+                    int i = list[t], a = label[i], j = l[t];
+                    ub[i] = q[3*KMEANS_CHUNK + t];
+                    lb[i] = q[4*KMEANS_CHUNK + t];
+                    if (j == a) continue;
+                    label[i] = j;
+                    kmeans_add(s, p, n, i, a, -(double)wt[i]);
+                    kmeans_add(s, p, n, i, j, wt[i]);
+                    changed++;
+                }
             }
-            labels[p] = bestc;
-        }
-
-        long *sumr = calloc(k, sizeof(long));
-        long *sumg = calloc(k, sizeof(long));
-        long *sumb = calloc(k, sizeof(long));
-        int *count = calloc(k, sizeof(int));
-
-        for (int p = 0; p < n; p++) {
-            int c = labels[p];
-            sumr[c] += img[p*3+0];
-            sumg[c] += img[p*3+1];
-            sumb[c] += img[p*3+2];
-            count[c]++;
-        }
-        for (int c = 0; c < k; c++) {
-            if (count[c] > 0) {
-                centroids[c*3+0] = sumr[c] / count[c];
-                centroids[c*3+1] = sumg[c] / count[c];
-                centroids[c*3+2] = sumb[c] / count[c];
+            free(list);
+            free(l);
+            free(q);
+        }
+        if (it && !changed) break;
+        for (int t=0; t<nt; t++) {
+            for (int j=0; j<k*4; j++) sum[j] += part[(size_t)t*k*4 + j];
+        }
+
+        // move the centers to the means, and how far each one went
+        r1 = 0;
+        m1 = m2 = 0;
+        for (int j=0; j<k; j++) {
+            move[j] = 0;
+            if (!sum[j*4+3]) continue;
+            float o[3] = { c[j*3], c[j*3+1], c[j*3+2] };
+            for (int t=0; t<3; t++) c[j*3+t] = sum[j*4+t] / sum[j*4+3];
+            move[j] = sqrtf(kmeans_cd2(c + j*3, o));
+            if (move[j] > m1) {
+                m2 = m1;
+                m1 = move[j];
+                r1 = j;
+            } else if (move[j] > m2) {
+                m2 = move[j];
+            }
+        }
+        if (it+1 >= iterations || m1 == 0) break;
+
+        for (int j=0; j<k; j++) {
+            float d = FLT_MAX;
+            for (int t=0; t<k; t++) {
+                float e = kmeans_cd2(c + j*3, c + t*3);
+                if (t != j && e < d) d = e;
+            }
+            half[j] = sqrtf(d) / 2;
+        }
+    }
+
+    free(lb);
+    free(ub);
+    free(label);
+    free(part);
+    free(sum);
+    free(move);
+    free(half);
+}
+
+// Replace every pixel of img by its nearest center. A 15bit bucket is an 8x8x8 cube of
+// colors: when its center is nearer to one center than to any other by more than the
+// cube diameter, the whole bucket maps to it in idx. The other buckets present in img
+// get a 512 entry table for the remaining bits, filled by the SIMD nearest kernel, so
+// every pixel gets the same center as a nearest search would give, in one pass.
+static void kmeans_map(unsigned char *img, int width, int height, float *c, int k)
+{
+    uint8_t *used = calloc(32768, 1);
+    for (size_t i=0; i<(size_t)width*height; i++) used[HIST_HI(img + i*3)] = 1;
+
+    int *idx = malloc(32768 * sizeof(int));
+    int *mixed = malloc(32768 * sizeof(int));
+    int n_sub = 0;
+    for (int hi=0; hi<32768; hi++) {
+        if (!used[hi]) continue;
+        float m[3] = { (hi>>10)*8 + 3.5f, (hi>>5&31)*8 + 3.5f, (hi&31)*8 + 3.5f };
+        float b1 = FLT_MAX, b2 = FLT_MAX;
+        int best = 0;
+        for (int j=0; j<k; j++) {
+            float d = kmeans_cd2(m, c + j*3);
+            if (d < b1) {
+                b2 = b1;
+                b1 = d;
+                best = j;
+            } else if (d < b2) {
+                b2 = d;
+            }
+        }
+        if (sqrtf(b2) - sqrtf(b1) > 2 * 3.5f * 1.7321f + 1e-3f) {
+            idx[hi] = best;
+        } else {
+            idx[hi] = k + n_sub;
+            mixed[n_sub++] = hi;
+        }
+    }
+
+    uint16_t (*sub)[512] = malloc((n_sub ? n_sub : 1) * sizeof(*sub));
+    #pragma omp parallel
+    {
+        float *q = malloc(512 * 5 * sizeof(float)); // r, g, b, d1, d2
+        #pragma omp for schedule(static)
+        for (int t=0; t<n_sub; t++) {
+            int hi = mixed[t];
+            for (int lo=0; lo<512; lo++) {
+                q[lo] = (hi>>10)<<3 | lo>>6;
+                q[512 + lo] = (hi>>5&31)<<3 | (lo>>3&7);
+                q[1024 + lo] = (hi&31)<<3 | (lo&7);
+            }
+            imgp_simd.nearest(q, q + 512, q + 1024, 512, c, k, sub[t], q + 1536, q + 2048);
+        }
+        free(q);
+    }
+
+    // a row of labels first: reading and writing img in one loop is twice as slow
+    unsigned char *rgb = malloc(k * 3);
+    for (int j=0; j<k*3; j++) rgb[j] = c[j] + .5f;
+    #pragma omp parallel
+    {
+        uint16_t *l = malloc(width * sizeof(uint16_t));
+        #pragma omp for schedule(static)
+        for (int y=0; y<height; y++) {
+            unsigned char *pix = img + (size_t)y*width*3;
+            for (int x=0; x<width; x++, pix += 3) {
+                int t = idx[HIST_HI(pix)];
+                l[x] = t < k ? t : sub[t - k][HIST_LO(pix)];
+            }
+            pix = img + (size_t)y*width*3;
+            for (int x=0; x<width; x++, pix += 3) {
+                pix[0] = rgb[l[x]*3];
+                pix[1] = rgb[l[x]*3+1];
+                pix[2] = rgb[l[x]*3+2];
             }
         }
-        free(sumr); free(sumg); free(sumb); free(count);
+        free(l);
     }
 
-    for (int p = 0; p < n; p++) {
-        int c = labels[p];
-        img[p*3+0] = centroids[c*3+0];
-        img[p*3+1] = centroids[c*3+1];
-        img[p*3+2] = centroids[c*3+2];
+    free(rgb);
+    free(sub);
+    free(mixed);
+    free(idx);
+    free(used);
+}
+
+// k-means clustering of the colors of img, which is replaced by the centers. The colors
+// are clustered as a histogram, so an iteration costs the same at any resolution. When
+// sample > 0 and img has more pixels, the centers are fitted on a copy downscaled to
+// sample pixels, and img is only read once more to assign its pixels to them.
+void filter_kmeans(unsigned char *img, int width, int height, int k, int iterations, int sample)
+{
+    color_hist hist;
+    if (sample > 0 && (double)width * height > sample) {
+        double f = sqrt(sample / ((double)width * height));
+        int sw = width * f, sh = height * f;
+        if (sw < 1) sw = 1;
+        if (sh < 1) sh = 1;
+        unsigned char *small = malloc((size_t)sw * sh * 3);
+        stbir_resize_uint8_srgb(img, width, height, 0, small, sw, sh, 0, 3);
+        imgp_histogram(&hist, small, sw, sh);
+        free(small);
+    } else {
+        imgp_histogram(&hist, img, width, height);
     }
+    if (k > hist.n) k = hist.n;
+    if (k > 65535) k = 65535; // labels are 16bit
+    if (k < 1) {
+        free(hist.e);
+        return;
+    }
+    imgp_simd_init();
+
+    uint32_t *wt;
+    float *p = kmeans_planar(&hist, &wt);
+    float *c = malloc(k * 3 * sizeof(float));
+    kmeans_fit(p, wt, hist.n, k, iterations, c);
+    kmeans_map(img, width, height, c, k);
 
-    free(centroids);
-    free(labels);
+    free(c);
+    free(wt);
+    free(p);
+    free(hist.e);
 }
 
 double magic_kernel[4*4] = {
@@ -297,17 +1095,9 @@ double gaussian_kernel[3*3] = {
     1.0/16, 2.0/16, 1.0/16,
 };
 
-double sobel_x_kernel[3*3] = {
-    -1.0, 0.0, 1.0,
-    -2.0, 0.0, 2.0,
-    -1.0, 0.0, 1.0,
-};
-
-double sobel_y_kernel[3*3] = {
-    -1.0, -2.0, -1.0,
-    0.0,  0.0,  0.0,
-    1.0,  2.0,  1.0,
-};
+// magic_kernel and gaussian_kernel are the outer products of these, for imgp_filter_sep
+double magic_kernel_1d[4] = { 1/8.0, 3/8.0, 3/8.0, 1/8.0 };
+double gaussian_kernel_1d[3] = { 1/4.0, 2/4.0, 1/4.0 };
 
 void usage(FILE* fp, char** argv)
 {
@@ -322,173 +1112,204 @@ void usage(FILE* fp, char** argv)
         "-n                 Enable noise removal (Gaussian blur)\n"
         "-e                 Enable edge-preserving blur (blur non-edges)\n"
         "-r <dimension>     Resize image to specified width or height\n"
-        "-d                 Enable debug mode\n"
+        "                   (a binary PPM is resized while it is read, in little memory)\n"
+        "-d                 Enable debug mode (writes debug images, not with -batch)\n"
         "-x                 Enable dilation\n"
+        "-ml                Decompose all colors in one scan of the palette map instead of\n"
+        "                   one bitmap per color; holds all paths at once, not with -x.\n"
+        "                   Not identical to the default: ambiguous turns are resolved by the\n"
+        "                   minority policy on the label map instead of on each color, so\n"
+        "                   about 0.3-0.7%% of the paths differ; takes up to about 2.4x the memory\n"
         "-a                 Enable alpha channel processing\n"
         "-cx <num>          Enable custom bit processing with specified bit value\n"
         "-s <scale>         Apply scaling with specified scale\n"
         "-posterize <num>   Apply posterization with specified levels\n"
         "-kmeans <num>      Apply k-means clustering with specified number of colors\n"
+        "-ksample <num>     Fit k-means on a copy downscaled to num pixels, for large images\n"
         "-turd <num>        Set turdsize for potrace (removes small paths) [default: 2]\n"
         "-alpha <num>       Set alphamax for potrace (edge smoothness) [default: 1.0]\n"
         "-opttol <num>      Set opttolerance for potrace (curve optimization) [default: 0.2]\n"
+        "-optwindow <num>   Join at most num segments into one curve, bounds the time of\n"
+        "                   curve optimization on long smooth paths, 0 for no limit [default: 0]\n"
+        "-tile <size>       Trace large images in tiles of size pixels with a global palette\n"
+        "                   (-d then writes no posterized or layer images)\n"
+        "-j <num>           Number of threads, 0 for all cores [default: 1]\n"
+        "-batch <src>       Vectorize a directory, a glob pattern or a list file, -j images at a time\n"
+        "                   (-o is a pattern such as out/%%s.svg, or a directory)\n"
+        "-manifest <file>   Write the JSONL batch manifest to file [default: stdout]\n"
+        "                   (inputs whose output names clash, such as a/x.jpg and b/x.png, are\n"
+        "                   traced once; the others are reported as \"duplicate output\")\n"
+        "-stats <fmt>       Print stage times and counters to stderr as table or json\n"
+        "                   (with -batch they are added to the manifest)\n"
         "\n",
         argv[0]);
 }
 
-int main(int argc, char* argv[])
+typedef struct {
+    int color, flag, bit, noise_removal, edge_blur, levels, colors, ksample, turdsize, optwindow, tile;
+    float scale, resize;
+    double alphamax, opttolerance;
+} img2vec_opt;
+
+// binary PPM (P6, maxval 255) read one row at a time
+typedef struct {
+    FILE *fp;
+    int w, y;       // y is the row in row
+    uint8_t *row;
+    int bad;        // a row before y was asked, the result is wrong
+} ppm_stream;
+
+// header of a P6 file, returns 0 when fp is not one
+static int ppm_header(FILE *fp, int *w, int *h)
 {
-    char *name = argv[1];
-    char *outfile = "img2vec.eps";
-    int color = 32;
-    int flag = 0;
-    float scale = 2;
-    int bit = 4;
-    int noise_removal = 0;
-    int edge_blur = 0;
-    float resize = 0;
-    int levels = 0;
-    int colors = 0;
-    int turdsize = 2;
-    double alphamax = 1.0;
-    double opttolerance = 0.2;
+    int v[3], c;
+    if (fgetc(fp) != 'P' || fgetc(fp) != '6') return 0;
+    for (int i=0; i<3; i++) {
+        while ((c = fgetc(fp)) == '#' || isspace(c)) {
+            if (c == '#') while ((c = fgetc(fp)) != '\n' && c != EOF);
+        }
+        if (!isdigit(c)) return 0;
+        for (v[i] = 0; isdigit(c); c = fgetc(fp)) v[i] = v[i]*10 + c - '0';
+    }
+    *w = v[0];
+    *h = v[1];
+    return v[0] > 0 && v[1] > 0 && v[2] == 255; // c was the single whitespace before the data
+}
 
-    if (argc <=1) {
-        usage(stderr, argv);
+// input callback of stb_image_resize2: rows are asked once each, from top to bottom
+static const void *ppm_row(void *out, const void *in, int n, int x, int y, void *context)
+{
+    ppm_stream *s = context;
+    (void)out; (void)in; (void)n; // the row is handed out in place
+    if (y < s->y) s->bad = 1; // the file can not be read back, fail the resize
+    while (s->y < y) {
+        if (fread(s->row, 3, s->w, s->fp) != (size_t)s->w) memset(s->row, 0, s->w * 3); // short file
+        s->y++;
+    }
+    return s->row + x*3;
+}
+
+// decode a P6 file straight into the size scaled by resize, with only one row of the
+// input in memory. Returns 0 when name is not a P6 file, the new size is empty or the
+// resize fails, so that the caller loads it the usual way. *w and *h get the new size.
+static uint8_t *ppm_load_resized(char *name, float resize, int *w, int *h)
+{
+    int iw, ih;
+    FILE *fp = fopen(name, "rb");
+    if (!fp) return 0;
+    if (!ppm_header(fp, &iw, &ih)) {
+        fclose(fp);
         return 0;
     }
-    for (int i=1; i<argc; i++) {
-        if (!strcmp(argv[i], "-o")) {
-            outfile = argv[++i];
-        } else if (!strcmp(argv[i], "-c")) {
-            color = atoi(argv[++i]);
-        } else if (!strcmp(argv[i], "-d")) {
-            flag |= 1; // debug
-        } else if (!strcmp(argv[i], "-x")) {
-            flag |= 2; // dilate
-        } else if (!strcmp(argv[i], "-a")) {
-            flag |= 4; // alpha
-        } else if (!strcmp(argv[i], "-b")) {
-            flag |= 8; // blur
-            scale = atof(argv[++i]);
-        } else if (!strcmp(argv[i], "-cx")) {
-            flag |= 16;
-            bit = atoi(argv[++i]);
-        } else if (!strcmp(argv[i], "-svg")) {
-            flag |= 32;
-        } else if (!strcmp(argv[i], "-s")) {
-            flag |= 64;
-            scale = atof(argv[++i]);
-        } else if (!strcmp(argv[i], "-n")) {
-            noise_removal = 1;
-        } else if (!strcmp(argv[i], "-e")) {
-            edge_blur = 1;
-        } else if (!strcmp(argv[i], "-r")) {
-            resize = atof(argv[++i]);
-        } else if (!strcmp(argv[i], "-posterize")) {
-            levels = atof(argv[++i]);
-        } else if (!strcmp(argv[i], "-kmeans")) {
-            colors = atof(argv[++i]);
-        } else if (!strcmp(argv[i], "-turd")) {
-            turdsize = atoi(argv[++i]);
-        } else if (!strcmp(argv[i], "-alpha")) {
-            alphamax = atof(argv[++i]);
-        } else if (!strcmp(argv[i], "-opttol")) {
-            opttolerance = atof(argv[++i]);
-        } else if (!strcmp(argv[i], "-h")) {
-            usage(stderr, argv);
-            return 0;
-        } else {
-            name = argv[i];
-        }
+    *w = iw * resize;
+    *h = ih * resize;
+    if (*w <= 0 || *h <= 0) {
+        fclose(fp);
+        return 0;
+    }
+    ppm_stream s = { fp, iw, -1, malloc((size_t)iw * 3), 0 };
+    uint8_t *pixels = malloc((size_t)*w * *h * 3);
+    STBIR_RESIZE r;
+    if (s.row && pixels) {
+        stbir_resize_init(&r, 0, iw, ih, 0, pixels, *w, *h, 0, STBIR_RGB, STBIR_TYPE_UINT8_SRGB);
+        stbir_set_pixel_callbacks(&r, ppm_row, 0);
+        stbir_set_user_data(&r, &s);
     }
+    if (!s.row || !pixels || !stbir_resize_extended(&r) || s.bad) {
+        free(pixels);
+        pixels = 0;
+    }
+    free(s.row);
+    fclose(fp);
+    return pixels;
+}
 
+// load name, run the filters of o and write the vector image to outfile.
+// returns the number of layers, -1 when the image could not be loaded, -2 when outfile could not be written.
+int vectorize(char *name, char *outfile, img2vec_opt *o, oct_quant *q, img2vec_stat *st)
+{
     uint8_t *pixels;
     int w, h, bpp;
-    pixels = stbi_load(name, &w, &h, &bpp, 3);
-    if (!pixels) {
-        printf("Error loading image: %s\n", stbi_failure_reason());
-        return 1;
-    }
+    int flag = o->flag;
+    float scale = o->scale;
+    double start = now(), t = start;
+    // a PPM is resized while it is read, so the full size image is never in memory
+    int streamed = 0;
+    pixels = o->resize > 0 ? ppm_load_resized(name, o->resize, &w, &h) : 0;
+    if (pixels) streamed = 1;
+    else pixels = stbi_load(name, &w, &h, &bpp, 3);
+    st->t[ST_DECODE] = st->t[ST_TOTAL] = now() - t;
+    if (!pixels) return -1;
 
-    if (resize > 0) {
-        int new_w = w * resize;
-        int new_h = h * resize;
-        printf("resized: %dx%d\n", new_w, new_h);
-        uint8_t *resized = malloc(new_w * new_h * 3);
-        stbir_resize_uint8_srgb(pixels, w, h, 0, resized, new_w, new_h, 0, 3);
-        free(pixels);
-        pixels = resized;
-        w = new_w;
-        h = new_h;
+    t = now();
+    if (o->resize > 0) {
+        if (!streamed) {
+            int new_w = w * o->resize;
+            int new_h = h * o->resize;
+            uint8_t *resized = malloc(new_w * new_h * 3);
+            stbir_resize_uint8_srgb(pixels, w, h, 0, resized, new_w, new_h, 0, 3);
+            free(pixels);
+            pixels = resized;
+            w = new_w;
+            h = new_h;
+        }
+        if (!(flag&128)) printf("resized: %dx%d\n", w, h);
         if (flag&1) stbi_write_jpg("resized.jpg", w, h, 3, pixels, 0);
     }
 
-    if (levels>0) filter_posterize(pixels, w, h, levels);
-    if (colors>0) filter_kmeans(pixels, w, h, colors, 10);
+    st->t[ST_RESIZE] = now() - t;
+
+    t = now();
+    if (o->levels>0) filter_posterize(pixels, w, h, o->levels);
+    st->t[ST_POSTERIZE] = now() - t;
+    t = now();
+    if (o->colors>0) filter_kmeans(pixels, w, h, o->colors, 10, o->ksample);
+    st->t[ST_KMEANS] = now() - t;
 
+    t = now();
     if (flag&8) {
         int sx = w*scale;
         int sy = h*scale;
         uint8_t *posterized = malloc(sx*sy *3 *2);
         stbir_resize_uint8_srgb(pixels, w, h, 0, posterized+sx*sy*3, sx, sy, 0, 3);
-        imgp_filter(posterized+sx*sy*3, sx, sy, posterized, magic_kernel, 4, 1, 0);
+        imgp_filter_sep(posterized+sx*sy*3, sx, sy, posterized, magic_kernel_1d, magic_kernel_1d, 4);
         stbir_resize_uint8_srgb(posterized, sx, sy, 0, pixels, w, h, 0, 3);
         if (flag&1) stbi_write_jpg("magic.jpg", w, h, 3, pixels, 0);
         free(posterized);
     }
 
-    if (noise_removal) {
+    if (o->noise_removal) {
         uint8_t *denoised = malloc(w * h * 3);
-        imgp_filter(pixels, w, h, denoised, gaussian_kernel, 3, 1, 0);
+        imgp_filter_sep(pixels, w, h, denoised, gaussian_kernel_1d, gaussian_kernel_1d, 3);
         memcpy(pixels, denoised, w * h * 3);
         free(denoised);
         if (flag&1) stbi_write_jpg("denoised.jpg", w, h, 3, pixels, 0);
     }
 
-    if (edge_blur) {
-        uint8_t *gray = malloc(w * h);
-        imgp_gray(pixels, w, h, w, gray, w);
-        uint8_t *edge_x = malloc(w * h * 3);
-        uint8_t *edge_y = malloc(w * h * 3);
-        imgp_filter(pixels, w, h, edge_x, sobel_x_kernel, 3, 1, 0);
-        imgp_filter(pixels, w, h, edge_y, sobel_y_kernel, 3, 1, 0);
-        uint8_t *edges = malloc(w * h);
-        for (int i = 0; i < w * h; i++) {
-            int ex = abs(edge_x[i * 3]);
-            int ey = abs(edge_y[i * 3]);
-            edges[i] = (uint8_t)sqrt(ex * ex + ey * ey);
-            if (edges[i] > 255) edges[i] = 255;
-        }
-        free(edge_x);
-        free(edge_y);
+    if (o->edge_blur) {
         uint8_t *blurred = malloc(w * h * 3);
-        imgp_filter(pixels, w, h, blurred, gaussian_kernel, 3, 1, 0);
-        for (int i = 0; i < w * h * 3; i++) {
-            int idx = i / 3;
-            float blend = edges[idx] / 255.0;
-            pixels[i] = (uint8_t)(pixels[i] * blend + blurred[i] * (1 - blend));
-        }
-        free(gray);
-        free(edges);
-        free(blurred);
+        imgp_edge_blur(pixels, w, h, blurred);
+        free(pixels);
+        pixels = blurred;
         if (flag&1) stbi_write_jpg("edge_blurred.jpg", w, h, 3, pixels, 0);
     }
 
     if (flag&16) {
         uint8_t *p = pixels;
         for (int n=0; n<w*h*3; n++) {
-            *p = ((*p)>>bit)<<bit;
+            *p = ((*p)>>o->bit)<<o->bit;
             p++;
         }
     }
+    st->t[ST_FILTER] = now() - t;
+    t = now();
     if (flag&64) {
         int sx = w*scale;
         int sy = h*scale;
         uint8_t *posterized = malloc(sx*sy *3);
         if (scale<1) {
             uint8_t *pix = malloc(w*h *3);
-            imgp_filter(pixels, w, h, pix, magic_kernel, 4, 1, 0);
+            imgp_filter_sep(pixels, w, h, pix, magic_kernel_1d, magic_kernel_1d, 4);
             stbir_resize_uint8_srgb(pix, w, h, 0, posterized, sx, sy, 0, 3);
             free(pix);
         } else {
@@ -500,22 +1321,324 @@ int main(int argc, char* argv[])
         w = sx;
         h = sy;
     }
-    color_quant(pixels, w, h, color, outfile, flag, turdsize, alphamax, opttolerance);
+    st->t[ST_SCALE] = now() - t;
+    st->w = w;
+    st->h = h;
+    int n = color_quant(pixels, w, h, o->color, outfile, flag, o->turdsize, o->alphamax, o->opttolerance, o->optwindow, o->tile, q, st);
 
     stbi_image_free(pixels);
+    st->t[ST_TOTAL] = now() - start;
+    return n < 0 ? -2 : n;
+}
+
+static int is_image(char *name)
+{
+    static char *ext[] = { "jpg", "jpeg", "png", "bmp", "gif", "tga", "psd", "pnm", "ppm", "pgm", "hdr", "pic", 0 };
+    char *e = strrchr(name, '.');
+    if (!e) return 0;
+    for (int i=0; ext[i]; i++) if (!strcasecmp(e+1, ext[i])) return 1;
+    return 0;
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+// input files of a batch: the images in a directory, the matches of a glob pattern,
+// or the lines of a list file
+char **batch_list(char *src, int *n)
+{
+    char **list = 0;
+    int alloc = 0;
+    struct stat sb;
+    *n = 0;
+#define BATCH_ADD(s) do { \
+        if (*n >= alloc) list = realloc(list, (alloc += 64) * sizeof(char*)); \
+        list[(*n)++] = (s); \
+    } while (0)
+
+    if (!stat(src, &sb) && S_ISDIR(sb.st_mode)) {
+        DIR *d = opendir(src);
+        struct dirent *e;
+        if (!d) return 0;
+        while ((e = readdir(d))) {
+            if (e->d_name[0] == '.' || !is_image(e->d_name)) continue;
+            char *path = malloc(strlen(src) + strlen(e->d_name) + 2);
+            sprintf(path, "%s/%s", src, e->d_name);
+            BATCH_ADD(path);
+        }
+        closedir(d);
+        if (*n) qsort(list, *n, sizeof(char*), cmp_str);
+    } else if (strpbrk(src, "*?[")) {
+        glob_t g;
+        if (!glob(src, 0, 0, &g)) {
+            for (size_t i=0; i<g.gl_pathc; i++) BATCH_ADD(strdup(g.gl_pathv[i]));
+        }
+        globfree(&g);
+    } else {
+        FILE *fp = fopen(src, "r");
+        char line[4096];
+        if (!fp) return 0;
+        while (fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\r\n")] = 0;
+            if (!line[0] || line[0] == '#') continue;
+            BATCH_ADD(strdup(line));
+        }
+        fclose(fp);
+    }
+#undef BATCH_ADD
+    return list;
+}
+
+// output name for input: "%s" in pattern is replaced by the input name without
+// directory and extension, otherwise pattern is a directory
+void batch_outname(char *dst, size_t size, char *pattern, char *input, int svg)
+{
+    char base[1024];
+    char *p = strrchr(input, '/');
+    snprintf(base, sizeof(base), "%s", p ? p+1 : input);
+    if ((p = strrchr(base, '.')) && p != base) *p = 0;
+
+    if (!pattern) pattern = svg ? "%s.svg" : "%s.eps";
+    if ((p = strstr(pattern, "%s"))) {
+        snprintf(dst, size, "%.*s%s%s", (int)(p - pattern), pattern, base, p+2);
+    } else {
+        snprintf(dst, size, "%s/%s.%s", pattern, base, svg ? "svg" : "eps");
+    }
+}
+
+static void json_str(FILE *fp, char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(fp, "\\u%04x", *s);
+        else fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+// vectorize every image of src with jobs images in flight, one JSON line per image
+// is written to manifest (stdout when null) as soon as the image is done
+static char (*batch_out)[4096]; // output names, for batch_out_cmp
+
+static int batch_out_cmp(const void *a, const void *b)
+{
+    int i = *(const int *)a, j = *(const int *)b;
+    int c = strcmp(batch_out[i], batch_out[j]);
+    return c ? c : i - j;
+}
+
+int vectorize_batch(char *src, char *pattern, char *manifest, img2vec_opt *o, int jobs, int stats)
+{
+    int n, failed = 0;
+    FILE *mf = manifest ? fopen(manifest, "w") : stdout;
+    if (!mf) {
+        fprintf(stderr, "Error opening manifest: %s\n", manifest);
+        return 1;
+    }
+    char **list = batch_list(src, &n);
+    if (!list) {
+        fprintf(stderr, "Error reading batch: %s\n", src);
+        if (mf != stdout) fclose(mf);
+        return 1;
+    }
+
+    // inputs such as a/x.jpg and b/x.png get the same output name: only the first one in
+    // the list is traced, the others are reported as duplicates
+    char (*out)[4096] = malloc((size_t)n * sizeof(*out) + 1);
+    int *order = malloc((size_t)n * sizeof(int) + 1);
+    uint8_t *dup = calloc(n + 1, 1);
+    if (!out || !order || !dup) {
+        fprintf(stderr, "Error allocating batch: %s\n", strerror(errno));
+        for (int i=0; i<n; i++) free(list[i]);
+        free(list);
+        free(out);
+        free(order);
+        free(dup);
+        if (mf != stdout) fclose(mf);
+        return 1;
+    }
+    for (int i=0; i<n; i++) {
+        batch_outname(out[i], sizeof(out[i]), pattern, list[i], o->flag&32);
+        order[i] = i;
+    }
+    batch_out = out;
+    qsort(order, n, sizeof(int), batch_out_cmp);
+    for (int i=1; i<n; i++) {
+        if (!strcmp(out[order[i]], out[order[i-1]])) dup[order[i]] = 1;
+    }
+    o->flag |= 128; // palettes of concurrent images would interleave on stdout
+    o->flag &= ~1;  // and their debug images, which have fixed names, would overwrite each other
+
+#ifdef _OPENMP
+    if (jobs <= 0) jobs = omp_get_num_procs();
+#endif
+    #pragma omp parallel num_threads(jobs)
+    {
+#ifdef _OPENMP
+        omp_set_num_threads(1); // the images are the unit of parallelism
+#endif
+        oct_quant q = { 0 }; // octree nodes are reused for every image of this thread
+        #pragma omp for schedule(dynamic)
+        for (int i=0; i<n; i++) {
+            img2vec_stat st = { 0 };
+            int layers = dup[i] ? -3 : vectorize(list[i], out[i], o, &q, &st);
+
+            #pragma omp critical
+            {
+                fprintf(mf, "{\"input\":");
+                json_str(mf, list[i]);
+                fprintf(mf, ",\"output\":");
+                json_str(mf, out[i]);
+                if (layers < 0) {
+                    failed++;
+                    fprintf(mf, ",\"status\":\"error\",\"error\":\"%s\"", layers == -1 ? "load" : layers == -3 ? "duplicate output" : "write");
+                } else {
+                    fprintf(mf, ",\"status\":\"ok\",\"width\":%d,\"height\":%d,\"layers\":%d,\"bytes\":%lld",
+                            st.w, st.h, layers, st.bytes);
+                    if (stats) {
+                        fprintf(mf, ",\"stats\":");
+                        stat_json(mf, &st);
+                    }
+                }
+                fprintf(mf, ",\"time\":%.3f}\n", st.t[ST_TOTAL]);
+                fflush(mf);
+            }
+            stat_free(&st);
+        }
+        node_free(&q);
+    }
+
+    for (int i=0; i<n; i++) free(list[i]);
+    free(list);
+    free(out);
+    free(order);
+    free(dup);
+    if (mf != stdout) fclose(mf);
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    char *name = argv[1];
+    char *outfile = 0;
+    char *batch = 0;
+    char *manifest = 0;
+    img2vec_opt o = { .color = 32, .scale = 2, .bit = 4, .turdsize = 2, .alphamax = 1.0, .opttolerance = 0.2 };
+    int jobs = 1;
+    char *stats = 0;
+
+    if (argc <=1) {
+        usage(stderr, argv);
+        return 0;
+    }
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "-o")) {
+            outfile = argv[++i];
+        } else if (!strcmp(argv[i], "-c")) {
+            o.color = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-d")) {
+            o.flag |= 1; // debug
+        } else if (!strcmp(argv[i], "-x")) {
+            o.flag |= 2; // dilate
+        } else if (!strcmp(argv[i], "-ml")) {
+            o.flag |= 512; // multi-label decomposition
+        } else if (!strcmp(argv[i], "-a")) {
+            o.flag |= 4; // alpha
+        } else if (!strcmp(argv[i], "-b")) {
+            o.flag |= 8; // blur
+            o.scale = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-cx")) {
+            o.flag |= 16;
+            o.bit = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-svg")) {
+            o.flag |= 32;
+        } else if (!strcmp(argv[i], "-s")) {
+            o.flag |= 64;
+            o.scale = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-n")) {
+            o.noise_removal = 1;
+        } else if (!strcmp(argv[i], "-e")) {
+            o.edge_blur = 1;
+        } else if (!strcmp(argv[i], "-r")) {
+            o.resize = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-posterize")) {
+            o.levels = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-kmeans")) {
+            o.colors = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-ksample")) {
+            o.ksample = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-turd")) {
+            o.turdsize = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-alpha")) {
+            o.alphamax = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-opttol")) {
+            o.opttolerance = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-optwindow")) {
+            o.optwindow = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-tile")) {
+            o.tile = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-j")) {
+            jobs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-batch")) {
+            batch = argv[++i];
+        } else if (!strcmp(argv[i], "-manifest")) {
+            manifest = argv[++i];
+        } else if (!strcmp(argv[i], "-stats")) {
+            stats = argv[++i];
+        } else if (!strcmp(argv[i], "-h")) {
+            usage(stderr, argv);
+            return 0;
+        } else {
+            name = argv[i];
+        }
+    }
+
+    if (batch) return vectorize_batch(batch, outfile, manifest, &o, jobs, stats != 0);
+
+#ifdef _OPENMP
+    omp_set_num_threads(jobs>0 ? jobs : omp_get_num_procs());
+#endif
+
+    oct_quant q = { 0 };
+    img2vec_stat st = { 0 };
+    int r = vectorize(name, outfile ? outfile : "img2vec.eps", &o, &q, &st);
+    node_free(&q);
+    if (stats && r >= 0) {
+        if (!strcmp(stats, "json")) {
+            stat_json(stderr, &st);
+            fprintf(stderr, "\n");
+        } else {
+            stat_table(stderr, &st);
+        }
+    }
+    stat_free(&st);
+    if (r == -1) {
+        printf("Error loading image: %s\n", stbi_failure_reason());
+        return 1;
+    }
+    if (r == -2) {
+        printf("Error writing: %s\n", outfile ? outfile : "img2vec.eps");
+        return 1;
+    }
+    return 0;
 }
 
 #ifdef EMSCRIPTEN
 #include <emscripten/emscripten.h>
 EMSCRIPTEN_KEEPALIVE int process_image(uint8_t *data, int size, int colors, int turdsize, double alphamax, double opttolerance) {
     int w, h, bpp;
+    if (!stbi_info_from_memory(data, size, &w, &h, &bpp)) return -1;
+    // the image is decoded and histogrammed whole (5 bytes a pixel) before it is tiled
+    if ((long long)w * h > 50000000) return -2;
     uint8_t *pixels = stbi_load_from_memory(data, size, &w, &h, &bpp, 3);
     if (!pixels) return -1;
-    if (w * h > 10000000) {
-        stbi_image_free(pixels);
-        return -2;
-    }
-    color_quant(pixels, w, h, colors, "output.svg", 32, turdsize, alphamax, opttolerance);
+    int tile = w * h > 10000000 ? 1024 : 0; // large images in tiles, to stay in the heap
+    oct_quant q = { 0 };
+    color_quant(pixels, w, h, colors, "output.svg", 32, turdsize, alphamax, opttolerance, 0, tile, &q, 0);
+    node_free(&q);
     stbi_image_free(pixels);
     return 0;
 }
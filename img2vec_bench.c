@@ -0,0 +1,238 @@
+/* img2vec_bench: run the README configurations of img2vec and measure them
+ *
+ * ./img2vec_bench [-n runs] [-b ./img2vec] [-o bench.json] [-c old.json] [-f filter] [-- extra args]
+ *
+ * Each configuration is run n times in a scratch directory. One JSON line per
+ * configuration is written with the median, p95 and min wall time, the peak RSS and
+ * the output size, so that results of two versions can be diffed or compared with -c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+typedef struct {
+    char *name;
+    char *input;
+    char *args; // output file is always the last -o
+    char *output;
+} bench_t;
+
+// command lines of the README, with the output renamed
+static bench_t bench[] = {
+    { "girl1118419-c2", "girl-1118419_1280.jpg", "-c 2", "out.eps" },
+    { "pdq0041064-c8-a-b12", "publicdomainq-0041064ikt.jpg", "-c 8 -a -b 12", "out.eps" },
+    { "pdq0041064-svg-a", "publicdomainq-0041064ikt.jpg", "-svg -a", "out.svg" },
+    { "pdq0041064-svg-kmeans48", "publicdomainq-0041064ikt.jpg", "-svg -a -x -turd 1 -alpha 4 -opttol 0 -kmeans 48", "out.svg" },
+    { "pdq0017653-c5-a", "publicdomainq-0017653mro.jpg", "-c 5 -a", "out.eps" },
+    { "pdq0017653-svg-kmeans5", "publicdomainq-0017653mro.jpg", "-svg -kmeans 5 -a", "out.svg" },
+    { "hairdress-svg-a", "hairdress-4912246.jpg", "-svg -a", "out.svg" },
+    { "girl4716186-s0.4-c48", "girl-4716186_1920.jpg", "-svg -a -s 0.4 -c 48", "out.svg" },
+    { "girl4716186-s0.6-c48-x", "girl-4716186_1920.jpg", "-svg -a -s 0.6 -c 48 -x", "out.svg" },
+    { "sparkler-s0.4-c64", "sparkler-677774_1920.jpg", "-svg -s 0.4 -c 64", "out.svg" },
+    { "2435687439-svg", "2435687439_17e1f58a9c_o.jpg", "-svg", "out.svg" },
+    { "1098751-c48-cx4-b14", "1098751.jpg", "-c 48 -a -cx 4 -b 14", "out.eps" },
+    { "painting-s0.3-c18", "painting-4820485_1920.jpg", "-svg -s 0.3 -c 18 -cx 4", "out.svg" },
+    { "night-c16", "night-4926430_1920.jpg", "-c 16", "out.eps" },
+    { "night-svg-s0.3", "night-4926430_1920.jpg", "-svg -s 0.3", "out.svg" },
+    { "night-svg-s0.3-kmeans32", "night-4926430_1920.jpg", "-svg -s 0.3 -x -kmeans 32 -turd 5", "out.svg" },
+    { "2435687439-svg-c48-x", "2435687439_17e1f58a9c_o.jpg", "-svg -turd 1 -alpha 0 -opttol 0 -a -c 48 -x", "out.svg" },
+    { 0 }
+};
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(double*)a, y = *(double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// s as a JSON string
+static void json_str(FILE *fp, char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(fp, "\\u%04x", *s);
+        else fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+// run argv in dir, returns the exit status, wall time in *sec and peak RSS in KiB in *rss
+static int run(char **argv, char *dir, double *sec, long *rss)
+{
+    struct rusage ru;
+    int status;
+    double t = now();
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (!pid) {
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, 1);
+        if (chdir(dir)) _exit(127);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &ru) < 0) return -1;
+    *sec = now() - t;
+    *rss = ru.ru_maxrss;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// median of a previous result file for name, or 0
+static double old_median(char *file, char *name)
+{
+    char line[1024], key[256];
+    double m = 0;
+    FILE *fp = fopen(file, "r");
+    if (!fp) return 0;
+    snprintf(key, sizeof(key), "{\"name\":\"%s\",", name);
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = strstr(line, "\"median\":");
+        if (!strncmp(line, key, strlen(key)) && p) {
+            m = atof(p + 9);
+            break;
+        }
+    }
+    fclose(fp);
+    return m;
+}
+
+void usage(FILE* fp, char** argv)
+{
+    fprintf(fp,
+        "Usage: %s [options] [-- img2vec options]\n\n"
+        "Options:\n"
+        "-h                 Print this message\n"
+        "-n <num>           Runs per configuration [default: 5]\n"
+        "-b <path>          img2vec binary [default: ./img2vec]\n"
+        "-o <file>          Write the JSON lines to file [default: stdout]\n"
+        "-c <file>          Compare the medians with a previous result file\n"
+        "-f <text>          Only run configurations whose name contains text\n"
+        "\n",
+        argv[0]);
+}
+
+int main(int argc, char* argv[])
+{
+    char *binary = "./img2vec";
+    char *outfile = 0;
+    char *compare = 0;
+    char *filter = 0;
+    char *extra = "";
+    int runs = 5;
+    char extra_buf[1024] = "";
+
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "-n")) {
+            runs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-b")) {
+            binary = argv[++i];
+        } else if (!strcmp(argv[i], "-o")) {
+            outfile = argv[++i];
+        } else if (!strcmp(argv[i], "-c")) {
+            compare = argv[++i];
+        } else if (!strcmp(argv[i], "-f")) {
+            filter = argv[++i];
+        } else if (!strcmp(argv[i], "--")) {
+            for (i++; i<argc; i++) {
+                strncat(extra_buf, " ", sizeof(extra_buf) - strlen(extra_buf) - 1);
+                strncat(extra_buf, argv[i], sizeof(extra_buf) - strlen(extra_buf) - 1);
+            }
+            extra = extra_buf;
+        } else {
+            usage(stderr, argv);
+            return 0;
+        }
+    }
+    if (runs < 1) runs = 1;
+
+    // the child runs in a scratch directory, so paths have to be absolute
+    char bin[PATH_MAX], cwd[PATH_MAX], dir[] = "/tmp/img2vec_bench.XXXXXX";
+    if (!realpath(binary, bin)) {
+        fprintf(stderr, "Error: %s not found\n", binary);
+        return 1;
+    }
+    if (!getcwd(cwd, sizeof(cwd)) || !mkdtemp(dir)) {
+        fprintf(stderr, "Error creating scratch directory\n");
+        return 1;
+    }
+    FILE *fp = outfile ? fopen(outfile, "w") : stdout;
+    if (!fp) {
+        fprintf(stderr, "Error opening %s\n", outfile);
+        return 1;
+    }
+
+    int failed = 0;
+    double *t = malloc(runs * sizeof(double));
+    for (bench_t *b = bench; b->name; b++) {
+        char input[PATH_MAX + 256], output[PATH_MAX + 256], cmd[2048], args[2048];
+        char *av[64];
+        int ac = 0;
+        struct stat sb;
+
+        if (filter && !strstr(b->name, filter)) continue;
+        snprintf(input, sizeof(input), "%s/%s", cwd, b->input);
+        if (stat(input, &sb)) {
+            fprintf(stderr, "%-26s skipped, %s is missing\n", b->name, b->input);
+            continue;
+        }
+        snprintf(output, sizeof(output), "%s/%s", dir, b->output);
+        snprintf(cmd, sizeof(cmd), "%s%s", b->args, extra);
+        strcpy(args, cmd); // cmd is cut up by strtok
+
+        av[ac++] = bin;
+        av[ac++] = input;
+        for (char *s = strtok(cmd, " "); s && ac < 60; s = strtok(0, " ")) av[ac++] = s;
+        av[ac++] = "-o";
+        av[ac++] = output;
+        av[ac] = 0;
+
+        long rss = 0, r = 0;
+        int status = 0;
+        for (int i=0; i<runs && !status; i++) {
+            status = run(av, dir, &t[i], &r);
+            if (r > rss) rss = r;
+        }
+        if (status) {
+            fprintf(stderr, "%-26s failed (%d)\n", b->name, status);
+            fprintf(fp, "{\"name\":\"%s\",\"status\":\"error\"}\n", b->name);
+            failed++;
+            continue;
+        }
+        long long bytes = stat(output, &sb) ? 0 : (long long)sb.st_size;
+        unlink(output);
+
+        qsort(t, runs, sizeof(double), cmp_double);
+        double median = runs & 1 ? t[runs/2] : (t[runs/2-1] + t[runs/2]) / 2;
+        double p95 = t[(int)(0.95 * (runs - 1) + 0.5)];
+        fprintf(fp, "{\"name\":\"%s\",\"args\":", b->name);
+        json_str(fp, args);
+        fprintf(fp, ",\"runs\":%d,\"median\":%.4f,\"p95\":%.4f,\"min\":%.4f,\"maxrss_kb\":%ld,\"bytes\":%lld}\n",
+                runs, median, p95, t[0], rss, bytes);
+        fflush(fp);
+
+        fprintf(stderr, "%-26s median %7.3fs  p95 %7.3fs  rss %7ld KiB", b->name, median, p95, rss);
+        double m = compare ? old_median(compare, b->name) : 0;
+        if (m > 0) fprintf(stderr, "  %+6.1f%%", (median / m - 1) * 100);
+        fprintf(stderr, "\n");
+    }
+    free(t);
+    rmdir(dir);
+    if (fp != stdout) fclose(fp);
+    return failed ? 1 : 0;
+}
@@ -11,10 +11,20 @@
  *	imgp_ahash(gray, w, h, ahash);		// only 8bit
  *
  *	imgp_filter(in, w, h, out, kernel, kernel_size, divisor, offset);	// only 24bit
+ *	imgp_filter_sep(in, w, h, out, kx, ky, taps);	// separable kernel kx*ky, 24bit
+ *	imgp_edge_blur(in, w, h, out);			// blur flat areas only, 24bit
  *	imgp_color_quant(pixels, w, h, color);	// only 24bit
+ *	oct_quant q = { 0 };				// reentrant: palette in q.heap
+ *	oct_build(&q, pixels, w, h, color); ... node_free(&q);
  *	imgp_cq24to15(pixels, w, h, 3, pixels, 1);
  * */
 
+#include <math.h>
+#include <float.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 void imgp_gray(uint8_t *s, int sx, int sy, int stride, uint8_t *p, int gstride)
 {
 	for (int y=0; y<sy; y++) {
@@ -169,34 +179,458 @@ void imgp_ahash(uint8_t *s, int w, int h, uint8_t *ahash)
 	3/64.0, 9/64.0, 9/64.0, 3/64.0,
 	1/64.0, 3/64.0, 3/64.0, 1/64.0,
 };*/
+/* Row kernels of the filters, with SSE4.1/AVX2/AVX-512 versions picked at run time.
+ *	hrow: r[x] = (128 + sum w[k]*s[x+3k]) >> 8		8bit -> 6bit fraction
+ *	vrow: d[x] = clamp((2^19 + sum w[k]*r[k][x]) >> 20)	-> 8bit
+ *	frow: a[x] += k*s[x]					float, one tap of imgp_filter
+ *	nearest: l[x] = nearest of the k centers c (rgb) to the planar color r[x],g[x],b[x],
+ *		 d1[x], d2[x] = distance to it and to the second nearest
+ * Every version gives the same result as the C one. IMGP_SIMD=c|sse4.1|avx2|avx512 in the
+ * environment limits the choice. */
+static void imgp_hrow_c(int32_t *r, const uint8_t *s, size_t n, const int32_t *w, int taps)
+{
+	for (size_t x=0; x<n; x++) {
+		int32_t a = 128;
+		for (int k=0; k<taps; k++) a += w[k] * s[x + k*3];
+		r[x] = a >> 8;
+	}
+}
+
+static void imgp_vrow_c(uint8_t *d, int32_t **r, size_t n, const int32_t *w, int taps)
+{
+	for (size_t x=0; x<n; x++) {
+		int32_t a = 1<<19;
+		for (int k=0; k<taps; k++) a += w[k] * r[k][x];
+		a >>= 20;
+		d[x] = a<0 ? 0 : a>255 ? 255 : a;
+	}
+}
+
+static void imgp_frow_c(float *a, const uint8_t *s, size_t n, float k)
+{
+	for (size_t x=0; x<n; x++) a[x] += k * s[x];
+}
+
+static void imgp_nearest_c(const float *r, const float *g, const float *b, size_t n, const float *c, int k, uint16_t *l, float *d1, float *d2)
+{
+	for (size_t x=0; x<n; x++) {
+		float b1 = FLT_MAX, b2 = FLT_MAX;
+		int best = 0;
+		for (int j=0; j<k; j++) {
+			float dr = r[x] - c[j*3], dg = g[x] - c[j*3+1], db = b[x] - c[j*3+2];
+			float d = dr*dr + dg*dg;
+			d += db*db;
+			if (d < b1) {
+				b2 = b1;
+				b1 = d;
+				best = j;
+			} else if (d < b2) {
+				b2 = d;
+			}
+		}
+		l[x] = best;
+		d1[x] = sqrtf(b1);
+		d2[x] = sqrtf(b2);
+	}
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define IMGP_X86
+#include <immintrin.h>
+
+__attribute__((target("sse4.1")))
+static void imgp_hrow_sse41(int32_t *r, const uint8_t *s, size_t n, const int32_t *w, int taps)
+{
+	size_t x = 0;
+	for (; x+4 <= n; x+=4) {
+		__m128i a = _mm_set1_epi32(128);
+		for (int k=0; k<taps; k++) {
+			int32_t v;
+			memcpy(&v, s + x + k*3, 4);
+			a = _mm_add_epi32(a, _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)), _mm_set1_epi32(w[k])));
+		}
+		_mm_storeu_si128((__m128i*)(r + x), _mm_srai_epi32(a, 8));
+	}
+	imgp_hrow_c(r + x, s + x, n - x, w, taps);
+}
+
+__attribute__((target("sse4.1")))
+static void imgp_vrow_sse41(uint8_t *d, int32_t **r, size_t n, const int32_t *w, int taps)
+{
+	size_t x = 0;
+	for (; x+4 <= n; x+=4) {
+		__m128i a = _mm_set1_epi32(1<<19);
+		for (int k=0; k<taps; k++) {
+			a = _mm_add_epi32(a, _mm_mullo_epi32(_mm_loadu_si128((__m128i*)(r[k] + x)), _mm_set1_epi32(w[k])));
+		}
+		a = _mm_srai_epi32(a, 20);
+		a = _mm_packus_epi16(_mm_packs_epi32(a, a), a);
+		int32_t v = _mm_cvtsi128_si32(a);
+		memcpy(d + x, &v, 4);
+	}
+	int32_t *t[taps];
+	for (int k=0; k<taps; k++) t[k] = r[k] + x;
+	imgp_vrow_c(d + x, t, n - x, w, taps);
+}
+
+__attribute__((target("sse4.1")))
+static void imgp_frow_sse41(float *a, const uint8_t *s, size_t n, float k)
+{
+	size_t x = 0;
+	__m128 m = _mm_set1_ps(k);
+	for (; x+4 <= n; x+=4) {
+		int32_t v;
+		memcpy(&v, s + x, 4);
+		__m128 f = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+		_mm_storeu_ps(a + x, _mm_add_ps(_mm_loadu_ps(a + x), _mm_mul_ps(f, m)));
+	}
+	imgp_frow_c(a + x, s + x, n - x, k);
+}
+
+__attribute__((target("sse4.1")))
+static void imgp_nearest_sse41(const float *r, const float *g, const float *b, size_t n, const float *c, int k, uint16_t *l, float *d1, float *d2)
+{
+	size_t x = 0;
+	for (; x+4 <= n; x+=4) {
+		__m128 pr = _mm_loadu_ps(r + x), pg = _mm_loadu_ps(g + x), pb = _mm_loadu_ps(b + x);
+		__m128 b1 = _mm_set1_ps(FLT_MAX), b2 = b1;
+		__m128i best = _mm_setzero_si128();
+		for (int j=0; j<k; j++) {
+			__m128 dr = _mm_sub_ps(pr, _mm_set1_ps(c[j*3]));
+			__m128 dg = _mm_sub_ps(pg, _mm_set1_ps(c[j*3+1]));
+			__m128 db = _mm_sub_ps(pb, _mm_set1_ps(c[j*3+2]));
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+			__m128 lt1 = _mm_cmplt_ps(d, b1), lt2 = _mm_cmplt_ps(d, b2);
+			b2 = _mm_blendv_ps(_mm_blendv_ps(b2, d, lt2), b1, lt1);
+			b1 = _mm_blendv_ps(b1, d, lt1);
+			best = _mm_blendv_epi8(best, _mm_set1_epi32(j), _mm_castps_si128(lt1));
+		}
+		_mm_storel_epi64((__m128i*)(l + x), _mm_packus_epi32(best, best));
+		_mm_storeu_ps(d1 + x, _mm_sqrt_ps(b1));
+		_mm_storeu_ps(d2 + x, _mm_sqrt_ps(b2));
+	}
+	imgp_nearest_c(r + x, g + x, b + x, n - x, c, k, l + x, d1 + x, d2 + x);
+}
+
+__attribute__((target("avx2")))
+static void imgp_hrow_avx2(int32_t *r, const uint8_t *s, size_t n, const int32_t *w, int taps)
+{
+	size_t x = 0;
+	for (; x+8 <= n; x+=8) {
+		__m256i a = _mm256_set1_epi32(128);
+		for (int k=0; k<taps; k++) {
+			__m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(s + x + k*3)));
+			a = _mm256_add_epi32(a, _mm256_mullo_epi32(v, _mm256_set1_epi32(w[k])));
+		}
+		_mm256_storeu_si256((__m256i*)(r + x), _mm256_srai_epi32(a, 8));
+	}
+	imgp_hrow_c(r + x, s + x, n - x, w, taps);
+}
+
+__attribute__((target("avx2")))
+static void imgp_vrow_avx2(uint8_t *d, int32_t **r, size_t n, const int32_t *w, int taps)
+{
+	size_t x = 0;
+	for (; x+8 <= n; x+=8) {
+		__m256i a = _mm256_set1_epi32(1<<19);
+		for (int k=0; k<taps; k++) {
+			a = _mm256_add_epi32(a, _mm256_mullo_epi32(_mm256_loadu_si256((__m256i*)(r[k] + x)), _mm256_set1_epi32(w[k])));
+		}
+		a = _mm256_srai_epi32(a, 20);
+		__m128i p = _mm_packs_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+		_mm_storel_epi64((__m128i*)(d + x), _mm_packus_epi16(p, p));
+	}
+	int32_t *t[taps];
+	for (int k=0; k<taps; k++) t[k] = r[k] + x;
+	imgp_vrow_c(d + x, t, n - x, w, taps);
+}
+
+__attribute__((target("avx2")))
+static void imgp_frow_avx2(float *a, const uint8_t *s, size_t n, float k)
+{
+	size_t x = 0;
+	__m256 m = _mm256_set1_ps(k);
+	for (; x+8 <= n; x+=8) {
+		__m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(s + x))));
+		_mm256_storeu_ps(a + x, _mm256_add_ps(_mm256_loadu_ps(a + x), _mm256_mul_ps(f, m)));
+	}
+	imgp_frow_c(a + x, s + x, n - x, k);
+}
+
+__attribute__((target("avx2")))
+static void imgp_nearest_avx2(const float *r, const float *g, const float *b, size_t n, const float *c, int k, uint16_t *l, float *d1, float *d2)
+{
+	size_t x = 0;
+	for (; x+8 <= n; x+=8) {
+		__m256 pr = _mm256_loadu_ps(r + x), pg = _mm256_loadu_ps(g + x), pb = _mm256_loadu_ps(b + x);
+		__m256 b1 = _mm256_set1_ps(FLT_MAX), b2 = b1;
+		__m256i best = _mm256_setzero_si256();
+		for (int j=0; j<k; j++) {
+			__m256 dr = _mm256_sub_ps(pr, _mm256_set1_ps(c[j*3]));
+			__m256 dg = _mm256_sub_ps(pg, _mm256_set1_ps(c[j*3+1]));
+			__m256 db = _mm256_sub_ps(pb, _mm256_set1_ps(c[j*3+2]));
+			__m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+			__m256 lt1 = _mm256_cmp_ps(d, b1, _CMP_LT_OQ), lt2 = _mm256_cmp_ps(d, b2, _CMP_LT_OQ);
+			b2 = _mm256_blendv_ps(_mm256_blendv_ps(b2, d, lt2), b1, lt1);
+			b1 = _mm256_blendv_ps(b1, d, lt1);
+			best = _mm256_blendv_epi8(best, _mm256_set1_epi32(j), _mm256_castps_si256(lt1));
+		}
+		_mm_storeu_si128((__m128i*)(l + x), _mm_packus_epi32(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1)));
+		_mm256_storeu_ps(d1 + x, _mm256_sqrt_ps(b1));
+		_mm256_storeu_ps(d2 + x, _mm256_sqrt_ps(b2));
+	}
+	imgp_nearest_c(r + x, g + x, b + x, n - x, c, k, l + x, d1 + x, d2 + x);
+}
+
+__attribute__((target("avx512f")))
+static void imgp_hrow_avx512(int32_t *r, const uint8_t *s, size_t n, const int32_t *w, int taps)
+{
+	size_t x = 0;
+	for (; x+16 <= n; x+=16) {
+		__m512i a = _mm512_set1_epi32(128);
+		for (int k=0; k<taps; k++) {
+			__m512i v = _mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i*)(s + x + k*3)));
+			a = _mm512_add_epi32(a, _mm512_mullo_epi32(v, _mm512_set1_epi32(w[k])));
+		}
+		_mm512_storeu_si512(r + x, _mm512_srai_epi32(a, 8));
+	}
+	imgp_hrow_c(r + x, s + x, n - x, w, taps);
+}
+
+__attribute__((target("avx512f")))
+static void imgp_vrow_avx512(uint8_t *d, int32_t **r, size_t n, const int32_t *w, int taps)
+{
+	size_t x = 0;
+	for (; x+16 <= n; x+=16) {
+		__m512i a = _mm512_set1_epi32(1<<19);
+		for (int k=0; k<taps; k++) {
+			a = _mm512_add_epi32(a, _mm512_mullo_epi32(_mm512_loadu_si512(r[k] + x), _mm512_set1_epi32(w[k])));
+		}
+		a = _mm512_max_epi32(_mm512_srai_epi32(a, 20), _mm512_setzero_si512());
+		_mm_storeu_si128((__m128i*)(d + x), _mm512_cvtusepi32_epi8(a));
+	}
+	int32_t *t[taps];
+	for (int k=0; k<taps; k++) t[k] = r[k] + x;
+	imgp_vrow_c(d + x, t, n - x, w, taps);
+}
+
+__attribute__((target("avx512f")))
+static void imgp_frow_avx512(float *a, const uint8_t *s, size_t n, float k)
+{
+	size_t x = 0;
+	__m512 m = _mm512_set1_ps(k);
+	for (; x+16 <= n; x+=16) {
+		__m512 f = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i*)(s + x))));
+		_mm512_storeu_ps(a + x, _mm512_add_ps(_mm512_loadu_ps(a + x), _mm512_mul_ps(f, m)));
+	}
+	imgp_frow_c(a + x, s + x, n - x, k);
+}
+
+__attribute__((target("avx512f")))
+static void imgp_nearest_avx512(const float *r, const float *g, const float *b, size_t n, const float *c, int k, uint16_t *l, float *d1, float *d2)
+{
+	size_t x = 0;
+	for (; x+16 <= n; x+=16) {
+		__m512 pr = _mm512_loadu_ps(r + x), pg = _mm512_loadu_ps(g + x), pb = _mm512_loadu_ps(b + x);
+		__m512 b1 = _mm512_set1_ps(FLT_MAX), b2 = b1;
+		__m512i best = _mm512_setzero_si512();
+		for (int j=0; j<k; j++) {
+			__m512 dr = _mm512_sub_ps(pr, _mm512_set1_ps(c[j*3]));
+			__m512 dg = _mm512_sub_ps(pg, _mm512_set1_ps(c[j*3+1]));
+			__m512 db = _mm512_sub_ps(pb, _mm512_set1_ps(c[j*3+2]));
+			__m512 d = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dr, dr), _mm512_mul_ps(dg, dg)), _mm512_mul_ps(db, db));
+			__mmask16 lt1 = _mm512_cmp_ps_mask(d, b1, _CMP_LT_OQ), lt2 = _mm512_cmp_ps_mask(d, b2, _CMP_LT_OQ);
+			b2 = _mm512_mask_blend_ps(lt1, _mm512_mask_blend_ps(lt2, b2, d), b1);
+			b1 = _mm512_mask_blend_ps(lt1, b1, d);
+			best = _mm512_mask_blend_epi32(lt1, best, _mm512_set1_epi32(j));
+		}
+		_mm256_storeu_si256((__m256i*)(l + x), _mm512_cvtepi32_epi16(best));
+		_mm512_storeu_ps(d1 + x, _mm512_sqrt_ps(b1));
+		_mm512_storeu_ps(d2 + x, _mm512_sqrt_ps(b2));
+	}
+	imgp_nearest_c(r + x, g + x, b + x, n - x, c, k, l + x, d1 + x, d2 + x);
+}
+#endif
+
+static struct {
+	void (*hrow)(int32_t *r, const uint8_t *s, size_t n, const int32_t *w, int taps);
+	void (*vrow)(uint8_t *d, int32_t **r, size_t n, const int32_t *w, int taps);
+	void (*frow)(float *a, const uint8_t *s, size_t n, float k);
+	void (*nearest)(const float *r, const float *g, const float *b, size_t n, const float *c, int k, uint16_t *l, float *d1, float *d2);
+	const char *name;
+} imgp_simd;
+
+void imgp_simd_init()
+{
+	#pragma omp critical(imgp_simd)
+	if (!imgp_simd.name) {
+		imgp_simd.hrow = imgp_hrow_c;
+		imgp_simd.vrow = imgp_vrow_c;
+		imgp_simd.frow = imgp_frow_c;
+		imgp_simd.nearest = imgp_nearest_c;
+		const char *name = "c";
+#ifdef IMGP_X86
+		char *e = getenv("IMGP_SIMD");
+		int level = !e ? 3 : !strcmp(e, "avx512") ? 3 : !strcmp(e, "avx2") ? 2 : !strcmp(e, "sse4.1") ? 1 : 0;
+		__builtin_cpu_init();
+		if (level >= 3 && __builtin_cpu_supports("avx512f")) {
+			imgp_simd.hrow = imgp_hrow_avx512;
+			imgp_simd.vrow = imgp_vrow_avx512;
+			imgp_simd.frow = imgp_frow_avx512;
+			imgp_simd.nearest = imgp_nearest_avx512;
+			name = "avx512";
+		} else if (level >= 2 && __builtin_cpu_supports("avx2")) {
+			imgp_simd.hrow = imgp_hrow_avx2;
+			imgp_simd.vrow = imgp_vrow_avx2;
+			imgp_simd.frow = imgp_frow_avx2;
+			imgp_simd.nearest = imgp_nearest_avx2;
+			name = "avx2";
+		} else if (level >= 1 && __builtin_cpu_supports("sse4.1")) {
+			imgp_simd.hrow = imgp_hrow_sse41;
+			imgp_simd.vrow = imgp_vrow_sse41;
+			imgp_simd.frow = imgp_frow_sse41;
+			imgp_simd.nearest = imgp_nearest_sse41;
+			name = "sse4.1";
+		}
+#endif
+		imgp_simd.name = name;
+	}
+}
+
+/* Convolution of a 24bit image with the Ks*Ks kernel K (row major), divided by divisor
+   plus offset. Tap k is at offset k - (Ks-1)/2, and pixels outside of the image repeat
+   the edge. Each tap is added to a float row of sums at once. im and o must differ. */
 void imgp_filter(uint8_t *im, int w, int h, uint8_t *o, double *K, int Ks, double divisor, double offset)
 {
-	unsigned int ix, iy, x, y;
-	int kx, ky;
-	double r, g, b, p;
-
-	for (ix=0; ix<w; ix++) {
-		for (iy=0; iy<h; iy++) {
-			r = g = b = 0.0;
-			for (kx=-Ks; kx<=Ks; kx++) {
-				for (ky=-Ks; ky<=Ks; ky++) {
-					x = ix+kx;
-					y = iy+ky;
-					p = ((x<0) || (x>=w) || (y<0) || (y>=h)) ? 0 : im[(ix+kx + (iy+ky)*w)*3];
-					r += (K[(kx+Ks) + (ky+Ks)*(2*Ks+1)]/divisor) * p + offset;
-					p = ((x<0) || (x>=w) || (y<0) || (y>=h)) ? 0 : im[(ix+kx + (iy+ky)*w)*3 +1];
-					g += (K[(kx+Ks) + (ky+Ks)*(2*Ks+1)]/divisor) * p + offset;
-					p = ((x<0) || (x>=w) || (y<0) || (y>=h)) ? 0 : im[(ix+kx + (iy+ky)*w)*3 +2];
-					b += (K[(kx+Ks) + (ky+Ks)*(2*Ks+1)]/divisor) * p + offset;
+	int c = (Ks-1)/2;
+	size_t rs = (size_t)w*3;
+	imgp_simd_init();
+
+	#pragma omp parallel
+	{
+		uint8_t *pad = malloc(rs + Ks*3);
+		float *a = malloc(rs * sizeof(float));
+
+		#pragma omp for schedule(static)
+		for (int iy=0; iy<h; iy++) {
+			for (size_t x=0; x<rs; x++) a[x] = offset;
+			for (int ky=0; ky<Ks; ky++) {
+				int y = iy+ky-c;
+				uint8_t *s = im + (y<0 ? 0 : y>=h ? h-1 : y) * rs;
+				for (int i=0; i<c; i++) memcpy(pad + i*3, s, 3);
+				memcpy(pad + c*3, s, rs);
+				for (int i=c+w; i<w+Ks-1; i++) memcpy(pad + i*3, s + rs-3, 3);
+				for (int kx=0; kx<Ks; kx++) imgp_simd.frow(a, pad + kx*3, rs, K[kx + ky*Ks] / divisor);
+			}
+			uint8_t *d = o + iy*rs;
+			for (size_t x=0; x<rs; x++) d[x] = a[x]>255 ? 255 : a[x]<0 ? 0 : a[x];
+		}
+		free(a);
+		free(pad);
+	}
+}
+
+/* Separable convolution of a 24bit image with the kernel kx[i]*ky[j] of n*n taps, in
+   14bit fixed point. Each source row is padded with its edge pixels, filtered with kx
+   into a ring of n rows, and each output row is the ky weighted sum of the ring, so the
+   image is read once, row by row. Same taps and borders as imgp_filter, rounded instead
+   of truncated. im and o may be the same buffer (then it runs on one thread). */
+void imgp_filter_sep(uint8_t *im, int w, int h, uint8_t *o, double *kx, double *ky, int n)
+{
+	int c = (n-1)/2;
+	int32_t wx[n], wy[n];
+	for (int k=0; k<n; k++) {
+		wx[k] = lrint(kx[k] * 16384);
+		wy[k] = lrint(ky[k] * 16384);
+	}
+	imgp_simd_init();
+
+	int bands = 1;
+#ifdef _OPENMP
+	if (im != o) bands = omp_get_max_threads();
+#endif
+	if (bands > h) bands = h;
+
+	#pragma omp parallel for num_threads(bands) schedule(static)
+	for (int band=0; band<bands; band++) {
+		int y0 = h*band/bands, y1 = h*(band+1)/bands;
+		size_t rs = (size_t)w*3;
+		uint8_t *pad = malloc(rs + n*3);
+		int32_t *ring = malloc(rs*n * sizeof(int32_t));
+
+		int next = y0 - c; // next source row, kept in ring slot (row - y0 + c) % n
+		for (int y=y0; y<y1; y++) {
+			for (; next <= y - c + n-1; next++) {
+				uint8_t *s = im + (next<0 ? 0 : next>=h ? h-1 : next) * rs;
+				for (int i=0; i<c; i++) memcpy(pad + i*3, s, 3);
+				memcpy(pad + c*3, s, rs);
+				for (int i=c+w; i<w+n-1; i++) memcpy(pad + i*3, s + rs-3, 3);
+				imgp_simd.hrow(ring + ((next - y0 + c) % n) * rs, pad, rs, wx, n);
+			}
+
+			int32_t *r[n];
+			for (int k=0; k<n; k++) r[k] = ring + ((y - y0 + k) % n) * rs;
+			imgp_simd.vrow(o + y*rs, r, rs, wy, n);
+		}
+		free(ring);
+		free(pad);
+	}
+}
+
+
+/* load row y (clamped) of a 24bit image into p with one edge pixel on each side, and its gray into g */
+static inline void imgp_edge_row(uint8_t *im, int w, int h, int y, uint8_t *p, uint8_t *g)
+{
+	size_t rs = (size_t)w*3;
+	uint8_t *s = im + (y<0 ? 0 : y>=h ? h-1 : y) * rs;
+	memcpy(p, s, 3);
+	memcpy(p+3, s, rs);
+	memcpy(p+3+rs, s+rs-3, 3);
+	for (int x=0; x<w+2; x++) g[x] = (77*p[x*3] + 151*p[x*3+1] + 28*p[x*3+2] + 128) >> 8;
+}
+
+/* Edge preserving blur of a 24bit image in one pass. The Sobel magnitude e of the gray
+   image (up to 255) blends each pixel with its 3x3 Gaussian blur, o = (im*e + blur*(255-e))/255,
+   so edges stay sharp and flat areas are smoothed. Each band of rows keeps a ring of three
+   edge padded rows and their gray values. im and o must differ. */
+void imgp_edge_blur(uint8_t *im, int w, int h, uint8_t *o)
+{
+	int bands = 1;
+#ifdef _OPENMP
+	bands = omp_get_max_threads();
+#endif
+	if (bands > h) bands = h;
+
+	#pragma omp parallel for num_threads(bands) schedule(static)
+	for (int band=0; band<bands; band++) {
+		int y0 = h*band/bands, y1 = h*(band+1)/bands;
+		size_t rs = (size_t)w*3, ps = rs+6;
+		uint8_t *rgb = malloc(ps*3);	// row k is in slot (k - y0 + 1) % 3
+		uint8_t *gray = malloc((w+2)*3);
+#define SLOT(k)	(((k) - y0 + 1) % 3)
+		imgp_edge_row(im, w, h, y0-1, rgb + SLOT(y0-1)*ps, gray + SLOT(y0-1)*(w+2));
+		imgp_edge_row(im, w, h, y0, rgb + SLOT(y0)*ps, gray + SLOT(y0)*(w+2));
+
+		for (int y=y0; y<y1; y++) {
+			imgp_edge_row(im, w, h, y+1, rgb + SLOT(y+1)*ps, gray + SLOT(y+1)*(w+2));
+			uint8_t *pa = rgb + SLOT(y-1)*ps, *pm = rgb + SLOT(y)*ps, *pb = rgb + SLOT(y+1)*ps;
+			uint8_t *ga = gray + SLOT(y-1)*(w+2), *gm = gray + SLOT(y)*(w+2), *gb = gray + SLOT(y+1)*(w+2);
+			uint8_t *d = o + y*rs;
+			for (int x=1; x<=w; x++) {
+				int gx = (ga[x+1] + 2*gm[x+1] + gb[x+1]) - (ga[x-1] + 2*gm[x-1] + gb[x-1]);
+				int gy = (gb[x-1] + 2*gb[x] + gb[x+1]) - (ga[x-1] + 2*ga[x] + ga[x+1]);
+				int m2 = gx*gx + gy*gy;
+				int e = m2 >= 255*255 ? 255 : (int)sqrtf(m2);
+				for (int i=x*3; i<x*3+3; i++) {
+					int bl = (pa[i-3] + 2*pa[i] + pa[i+3] + 2*(pm[i-3] + 2*pm[i] + pm[i+3]) + pb[i-3] + 2*pb[i] + pb[i+3] + 8) >> 4;
+					int v = pm[i]*e + bl*(255-e) + 128;
+					*d++ = (v + (v>>8)) >> 8; // v/255 rounded
 				}
 			}
-			r = (r>255.0) ? 255.0 : ((r<0.0) ? 0.0 : r);
-			g = (g>255.0) ? 255.0 : ((g<0.0) ? 0.0 : g);
-			b = (b>255.0) ? 255.0 : ((b<0.0) ? 0.0 : b);
-			o[(ix + iy*w)*3] = r;
-			o[(ix + iy*w)*3 +1] = g;
-			o[(ix + iy*w)*3 +2] = b;
 		}
+#undef SLOT
+		free(gray);
+		free(rgb);
 	}
 }
 
@@ -301,18 +735,32 @@ oct_node pop_heap(node_heap *h)
 	return ret;
 }
 
-static oct_node oct_pool = 0;
-oct_node node_new(unsigned char idx, unsigned char depth, oct_node p)
+/* quantizer context. It owns its node arena and heap, so several images can be
+   quantized at the same time, and oct_reset() keeps the memory for the next image. */
+#define OCT_BLOCK	2048
+typedef struct {
+	oct_node pool;	/* node blocks in use, chained through parent of their first node */
+	oct_node spare;	/* blocks released by oct_reset */
+	int len;	/* nodes left in the first block of pool */
+	node_heap heap;
+} oct_quant;
+
+oct_node node_new(oct_quant *q, unsigned char idx, unsigned char depth, oct_node p)
 {
-	static int len = 0;
-	if (len <= 1) {
-		oct_node p = calloc(sizeof(oct_node_t), 2048);
-		p->parent = oct_pool;
-		oct_pool = p;
-		len = 2047;
+	if (q->len <= 1) {
+		oct_node b = q->spare;
+		if (b) {
+			q->spare = b->parent;
+			memset(b, 0, sizeof(oct_node_t) * OCT_BLOCK);
+		} else {
+			b = calloc(sizeof(oct_node_t), OCT_BLOCK);
+		}
+		b->parent = q->pool;
+		q->pool = b;
+		q->len = OCT_BLOCK-1;
 	}
 
-	oct_node x = oct_pool + len--;
+	oct_node x = q->pool + q->len--;
 	x->kid_idx = idx;
 	x->depth = depth;
 	x->parent = p;
@@ -320,14 +768,32 @@ oct_node node_new(unsigned char idx, unsigned char depth, oct_node p)
 	return x;
 }
 
-void node_free()
+/* forget the tree, but keep the arena and the heap buffer */
+void oct_reset(oct_quant *q)
+{
+	oct_node p;
+	while (q->pool) {
+		p = q->pool->parent;
+		q->pool->parent = q->spare;
+		q->spare = q->pool;
+		q->pool = p;
+	}
+	q->len = 0;
+	q->heap.n = 0;
+}
+
+void node_free(oct_quant *q)
 {
 	oct_node p;
-	while (oct_pool) {
-		p = oct_pool->parent;
-		free(oct_pool);
-		oct_pool = p;
+	oct_reset(q);
+	while (q->spare) {
+		p = q->spare->parent;
+		free(q->spare);
+		q->spare = p;
 	}
+	free(q->heap.buf);
+	q->heap.buf = 0;
+	q->heap.alloc = 0;
 }
 
 /* adding a color triple to octree */
@@ -336,25 +802,39 @@ void node_free()
    for most images to use a value of 5.  This affects how many nodes eventually
    end up in the tree and heap, thus smaller values helps with both speed
    and memory. */
-oct_node node_insert(oct_node root, unsigned char *pix)
+oct_node node_insert(oct_quant *q, oct_node root, unsigned char *pix, int n)
 {
 	unsigned char i, bit, depth = 0;
 	for (bit = 1 << 7; ++depth < OCT_DEPTH; bit >>= 1) {
 		i = !!(pix[1] & bit) * 4 + !!(pix[0] & bit) * 2 + !!(pix[2] & bit);
 		if (!root->kids[i]) {
-			root->kids[i] = node_new(i, depth, root);
+			root->kids[i] = node_new(q, i, depth, root);
 		}
 
 		root = root->kids[i];
 	}
 
-	root->r += pix[0];
-	root->g += pix[1];
-	root->b += pix[2];
-	root->count++;
+	root->r += (uint64_t)pix[0] * n;
+	root->g += (uint64_t)pix[1] * n;
+	root->b += (uint64_t)pix[2] * n;
+	root->count += n;
 	return root;
 }
 
+/* add the leaves of the tree to the heap, in depth first order. Adding them pixel by pixel
+   as the heap grew gave another layer order, but replaying that costs a heap update per
+   pixel; only the order differs, the palette colors are the same. */
+void heap_add_leaves(node_heap *h, oct_node p)
+{
+	if (!p->n_kids) {
+		heap_add(h, p);
+		return;
+	}
+	for (int i=0; i<8; i++) {
+		if (p->kids[i]) heap_add_leaves(h, p->kids[i]);
+	}
+}
+
 /* remove a node in octree and add its count and colors to parent node. */
 oct_node node_fold(oct_node p)
 {
@@ -387,26 +867,219 @@ void color_replace(oct_node root, unsigned char *pix)
 	pix[2] = root->b;
 }
 
+/* same as color_replace, but also return the palette index (heap position)
+   of the node the pixel belongs to */
+int color_index(oct_node root, unsigned char *pix)
+{
+	unsigned char i, bit;
+
+	for (bit = 1 << 7; bit; bit >>= 1) {
+		i = !!(pix[1] & bit) * 4 + !!(pix[0] & bit) * 2 + !!(pix[2] & bit);
+		if (!root->kids[i]) break;
+		root = root->kids[i];
+	}
+
+	pix[0] = root->r;
+	pix[1] = root->g;
+	pix[2] = root->b;
+	return root->heap_idx;
+}
+
+/* histogram of 24bit colors: each distinct color and its pixel count */
+typedef struct {
+	uint32_t key, count;	/* key is rgb */
+} hist_entry;
+
+typedef struct {
+	int n;
+	hist_entry *e;
+} color_hist;
+
+#define HIST_HI(p)	((p)[0]>>3<<10 | (p)[1]>>3<<5 | (p)[2]>>3)		/* 15bit bucket */
+#define HIST_LO(p)	(((p)[0]&7)<<6 | ((p)[1]&7)<<3 | ((p)[2]&7))	/* remaining 9bit */
+
+/* Count the colors of a 24bit image. Pixels are sorted into 15bit buckets (a counting
+   sort with a count table per thread, merged by prefix sums), then each bucket is
+   counted with a 512 entry table for the remaining bits. No hash table is touched at
+   random, and the result is the same for any number of threads. */
+void imgp_histogram(color_hist *t, unsigned char *im, int w, int h)
+{
+	int nt = 1;
+#ifdef _OPENMP
+	nt = omp_get_max_threads();
+#endif
+	uint32_t *cnt = calloc((size_t)nt * 32768, sizeof(uint32_t));	/* cnt[thread][bucket] */
+	uint32_t *start = malloc(32769 * sizeof(uint32_t));
+	uint16_t *lo = malloc((size_t)w * h * sizeof(uint16_t));
+	hist_entry **part = calloc(nt, sizeof(hist_entry*));
+	int *part_n = calloc(nt, sizeof(int));
+
+	#pragma omp parallel num_threads(nt)
+	{
+		int id = 0;
+#ifdef _OPENMP
+		id = omp_get_thread_num();
+#endif
+		uint32_t *c = cnt + (size_t)id * 32768;
+		#pragma omp for schedule(static)
+		for (int y=0; y<h; y++) {
+			unsigned char *pix = im + (size_t)y*w*3;
+			for (int x=0; x<w; x++, pix += 3) c[HIST_HI(pix)]++;
+		}
+
+		/* counts -> positions, bucket major and thread minor */
+		#pragma omp single
+		{
+			uint32_t s = 0;
+			for (int b=0; b<32768; b++) {
+				start[b] = s;
+				for (int i=0; i<nt; i++) {
+					uint32_t n = cnt[(size_t)i*32768 + b];
+					cnt[(size_t)i*32768 + b] = s;
+					s += n;
+				}
+			}
+			start[32768] = s;
+		}
+
+		/* same static schedule as above, so each thread sees the same rows */
+		#pragma omp for schedule(static)
+		for (int y=0; y<h; y++) {
+			unsigned char *pix = im + (size_t)y*w*3;
+			for (int x=0; x<w; x++, pix += 3) lo[c[HIST_HI(pix)]++] = HIST_LO(pix);
+		}
+
+		uint32_t c512[512] = { 0 };
+		int n = 0, alloc = 0;
+		hist_entry *e = 0;
+		#pragma omp for schedule(static)
+		for (int b=0; b<32768; b++) {
+			for (uint32_t i=start[b]; i<start[b+1]; i++) c512[lo[i]]++;
+			for (uint32_t i=start[b]; i<start[b+1]; i++) {
+				if (!c512[lo[i]]) continue;
+				if (n >= alloc) {
+					alloc += 4096;
+					e = realloc(e, alloc * sizeof(hist_entry));
+				}
+				uint32_t r = (b>>10)<<3 | lo[i]>>6, g = (b>>5&31)<<3 | (lo[i]>>3&7), bl = (b&31)<<3 | (lo[i]&7);
+				e[n].key = r<<16 | g<<8 | bl;
+				e[n++].count = c512[lo[i]];
+				c512[lo[i]] = 0;
+			}
+		}
+		part[id] = e;
+		part_n[id] = n;
+	}
+
+	/* join the per thread lists in bucket order */
+	t->n = 0;
+	for (int i=0; i<nt; i++) t->n += part_n[i];
+	t->e = malloc((t->n ? t->n : 1) * sizeof(hist_entry));
+	for (int i=0, n=0; i<nt; n += part_n[i], i++) {
+		if (part_n[i]) memcpy(t->e + n, part[i], part_n[i] * sizeof(hist_entry));
+		free(part[i]);
+	}
+	free(part);
+	free(part_n);
+	free(lo);
+	free(start);
+	free(cnt);
+}
+
 /* Building an octree and keep leaf nodes in a bin heap.  Afterwards remove first node
    in heap and fold it into its parent node (which may now be added to heap), until heap
-   contains required number of colors. */
-void imgp_color_quant(unsigned char *im, int w, int h, int n_colors)
+   contains required number of colors. The palette is left in q->heap.buf[1..n-1]. */
+oct_node oct_build(oct_quant *q, unsigned char *im, int w, int h, int n_colors)
 {
-	int i;
-	unsigned char *pix = im;
-	node_heap heap = { 0, 0, 0 };
+	color_hist hist;
+
+	/* insert each distinct color once with its count. The leaves go to the heap
+	   in tree order, so the palette does not depend on the histogram layout. */
+	oct_reset(q);
+	imgp_histogram(&hist, im, w, h);
+	oct_node root = node_new(q, 0, 0, 0);
+	for (int i=0; i < hist.n; i++) {
+		uint32_t k = hist.e[i].key;
+		unsigned char pix[3] = { k>>16, k>>8, k };
+		node_insert(q, root, pix, hist.e[i].count);
+	}
+	free(hist.e);
+	if (root->n_kids) heap_add_leaves(&q->heap, root);
+
+	while (q->heap.n > n_colors + 1) {
+		heap_add(&q->heap, node_fold(pop_heap(&q->heap)));
+	}
+	return root;
+}
+
+/* palette index of any 24bit color, without walking the tree per pixel. A 15bit table
+   holds the index when the tree ends within 5 levels (idx < 256); otherwise idx-256
+   selects a 512 entry table for the remaining 9 bits. Needs less than 256 colors. */
+typedef struct {
+	uint16_t idx[32768];
+	uint8_t (*sub)[512];
+	int n_sub;
+} oct_lut;
 
-	oct_node root = node_new(0, 0, 0);
-	for (i=0; i < w * h; i++, pix += 3) {
-		heap_add(&heap, node_insert(root, pix));
+void oct_lut_build(oct_lut *t, oct_node root)
+{
+	t->sub = 0;
+	t->n_sub = 0;
+	for (int hi=0; hi<32768; hi++) {
+		unsigned char pix[3] = { (hi>>10)<<3, (hi>>5&31)<<3, (hi&31)<<3 };
+		unsigned char i, bit;
+		oct_node p = root;
+		for (bit = 1 << 7; bit > 4; bit >>= 1) {
+			i = !!(pix[1] & bit) * 4 + !!(pix[0] & bit) * 2 + !!(pix[2] & bit);
+			if (!p->kids[i]) break;
+			p = p->kids[i];
+		}
+		if (bit <= 4 && p->n_kids) { /* deeper than 5 levels: walk the rest of the bits */
+			if (!(t->n_sub & 63)) t->sub = realloc(t->sub, (t->n_sub + 64) * 512);
+			for (int lo=0; lo<512; lo++) {
+				unsigned char c[3] = { pix[0] | lo>>6, pix[1] | (lo>>3&7), pix[2] | (lo&7) };
+				t->sub[t->n_sub][lo] = color_index(root, c);
+			}
+			t->idx[hi] = 256 + t->n_sub++;
+		} else {
+			t->idx[hi] = p->heap_idx;
+		}
 	}
+}
+
+void oct_lut_free(oct_lut *t)
+{
+	free(t->sub);
+	t->sub = 0;
+}
 
-	while (heap.n > n_colors + 1) {
-		heap_add(&heap, node_fold(pop_heap(&heap)));
+static inline int oct_lut_index(oct_lut *t, unsigned char *pix)
+{
+	int c = t->idx[HIST_HI(pix)];
+	return c < 256 ? c : t->sub[c - 256][HIST_LO(pix)];
+}
+
+/* write the palette index of every pixel to label */
+void imgp_color_map(oct_lut *t, unsigned char *im, int w, int h, uint8_t *label)
+{
+	#pragma omp parallel for schedule(static)
+	for (int y=0; y<h; y++) {
+		unsigned char *pix = im + (size_t)y*w*3;
+		uint8_t *l = label + (size_t)y*w;
+		for (int x=0; x<w; x++, pix += 3) l[x] = oct_lut_index(t, pix);
 	}
+}
+
+void imgp_color_quant(unsigned char *im, int w, int h, int n_colors)
+{
+	int i;
+	unsigned char *pix;
+	oct_quant q = { 0 };
 
-	/*for (i=1; i < heap.n; i++) {
-		oct_node got = heap.buf[i];
+	oct_node root = oct_build(&q, im, w, h, n_colors);
+
+	/*for (i=1; i < q.heap.n; i++) {
+		oct_node got = q.heap.buf[i];
 		double c = got->count;
 		got->r = got->r / c + .5;
 		got->g = got->g / c + .5;
@@ -415,12 +1088,24 @@ void imgp_color_quant(unsigned char *im, int w, int h, int n_colors)
 		       i, got->r, got->g, got->b, got->count);
 	}*/
 
-	for (i=0, pix = im; i < w * h; i++, pix += 3) {
-		color_replace(root, pix);
+	if (q.heap.n <= 256) {
+		oct_lut *t = malloc(sizeof(oct_lut));
+		oct_lut_build(t, root);
+		for (i=0, pix = im; i < w * h; i++, pix += 3) {
+			oct_node got = q.heap.buf[oct_lut_index(t, pix)];
+			pix[0] = got->r;
+			pix[1] = got->g;
+			pix[2] = got->b;
+		}
+		oct_lut_free(t);
+		free(t);
+	} else {
+		for (i=0, pix = im; i < w * h; i++, pix += 3) {
+			color_replace(root, pix);
+		}
 	}
 
-	node_free();
-	free(heap.buf);
+	node_free(&q);
 }
 
 // 24bit -> 15bit
@@ -11,6 +11,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 /* Copyright (C) 2001-2019 Peter Selinger.
    This file is part of Potrace. It is free software and it is covered
    by the GNU General Public License. See the file COPYING for details. */
@@ -46,6 +50,7 @@ struct potrace_param_s {
   double alphamax;     /* corner threshold */
   int opticurve;       /* use curve optimization? */
   double opttolerance; /* curve optimization tolerance */
+  int optwindow;       /* most segments joined into one curve, 0 for no limit */
   potrace_progress_t progress; /* progress callback function */
 };
 typedef struct potrace_param_s potrace_param_t;
@@ -100,6 +105,8 @@ struct potrace_state_s {
   int status;                       
   potrace_path_t *plist;            /* vector data */
   struct potrace_privstate_s *priv; /* private state */
+  double time[2];                   /* seconds in decomposition and curve fitting */
+  int optwindow_hits;               /* curve optimization searches cut by optwindow */
 };
 typedef struct potrace_state_s potrace_state_t;
 /* ---------------------------------------------------------------------- */
@@ -111,6 +118,15 @@ void potrace_param_free(potrace_param_t *p);
 /* trace a bitmap */
 potrace_state_t *potrace_trace(const potrace_param_t *param, 
 			       const potrace_bitmap_t *bm);
+/* trace a bitmap whose lower left corner sits at (x0,y0) of a larger
+   bitmap; paths are returned in the coordinates of the larger one */
+potrace_state_t *potrace_trace_at(const potrace_param_t *param, 
+				  const potrace_bitmap_t *bm, int x0, int y0);
+/* trace the labels c < n of a w*h map of labels (rows top down) with
+   trace[c] set, all of them in one scan; st[c] gets the state of label c */
+int potrace_trace_labels(const potrace_param_t *param, const unsigned char *map,
+			 int w, int h, int n, const unsigned char *trace,
+			 potrace_state_t **st);
 /* free a Potrace state */
 void potrace_state_free(potrace_state_t *st);
 /* return a static plain text version string identifying this version
@@ -462,6 +478,33 @@ struct sums_s {
   double y2;
 };
 typedef struct sums_s sums_t;
+/* bump allocator: memory is taken from big blocks and given back all at
+   once. Blocks that are given back are kept per thread for later traces. */
+struct arena_block_s {
+  struct arena_block_s *next;
+  size_t size, used;   /* bytes of data after the (16 byte aligned) header */
+};
+typedef struct arena_block_s arena_block_t;
+struct arena_s {
+  arena_block_t *head;  /* block being filled, then the older ones */
+};
+typedef struct arena_s arena_t;
+struct arena_mark_s {
+  arena_block_t *block;
+  size_t used;
+};
+typedef struct arena_mark_s arena_mark_t;
+/* memory of the curve fitting of a path: keep lives as long as the
+   state, tmp is emptied after each path */
+struct potrace_mem_s {
+  arena_t *keep;
+  arena_t *tmp;
+};
+typedef struct potrace_mem_s potrace_mem_t;
+/* paths and curves of a state live in its arena and are freed at once */
+struct potrace_privstate_s {
+  arena_t arena;
+};
 /* the path structure is filled in with information about a given path
    as it is accumulated and passed through the different stages of the
    Potrace algorithm. Backends only need to read the fcurve and fm
@@ -479,89 +522,133 @@ struct potrace_privpath_s {
   privcurve_t ocurve;  /* ocurve[om]: array of curve elements */
   privcurve_t *fcurve;  /* final curve: this points to either curve or
 		       ocurve. Do not free this separately. */
+  potrace_mem_t *mem;   /* arenas of the curve fitting */
+  int optwindow_hits;   /* searches of opticurve cut by the window */
 };
 typedef struct potrace_privpath_s potrace_privpath_t;
 /* shorter names */
 typedef potrace_privpath_t privpath_t;
 typedef potrace_path_t path_t;
-path_t *path_new(void);
-void path_free(path_t *p);
-void pathlist_free(path_t *plist);
-int privcurve_init(privcurve_t *curve, int n);
+void *arena_calloc(arena_t *a, size_t n, size_t size);
+arena_mark_t arena_mark(arena_t *a);
+void arena_release(arena_t *a, arena_mark_t m);
+void arena_merge(arena_t *dst, arena_t *src);
+void arena_free(arena_t *a);
+path_t *path_new(arena_t *a);
+int privcurve_init(privcurve_t *curve, int n, arena_t *a);
 void privcurve_to_curve(privcurve_t *pc, potrace_curve_t *c);
 #endif /* CURVE_H */
-#define SAFE_CALLOC(var, n, typ) \
-  if ((var = (typ *)calloc(n, sizeof(typ))) == NULL) goto calloc_error 
+#define ARENA_CALLOC(a, var, n, typ) \
+  if ((var = (typ *)arena_calloc(a, n, sizeof(typ))) == NULL) goto calloc_error
 /* ---------------------------------------------------------------------- */
-/* allocate and free path objects */
-path_t *path_new(void) {
+/* arena allocator */
+#define ARENA_HEADER ((sizeof(arena_block_t) + 15) & ~(size_t)15)
+#define ARENA_BLOCK (256*1024 - ARENA_HEADER)  /* data bytes of a block */
+#define ARENA_SPARE 16                         /* blocks kept per thread */
+static _Thread_local arena_block_t *arena_spare;  /* given back, ARENA_BLOCK each */
+static _Thread_local int arena_n_spare;
+/* give a block back to this thread, or to the system */
+static void arena_block_free(arena_block_t *b) {
+  if (b->size == ARENA_BLOCK && arena_n_spare < ARENA_SPARE) {
+    b->next = arena_spare;
+    arena_spare = b;
+    arena_n_spare++;
+  } else {
+    free(b);
+  }
+}
+/* n zeroed objects of the given size, 16 byte aligned, or NULL with
+   errno set */
+void *arena_calloc(arena_t *a, size_t n, size_t size) {
+  size_t bytes = (n * size + 15) & ~(size_t)15;
+  arena_block_t *b = a->head;
+  char *p;
+  if (!b || b->used + bytes > b->size) {
+    if (bytes <= ARENA_BLOCK && arena_spare) {
+      b = arena_spare;
+      arena_spare = b->next;
+      arena_n_spare--;
+    } else {
+      size_t size = bytes > ARENA_BLOCK ? bytes : ARENA_BLOCK;
+      b = (arena_block_t *)malloc(ARENA_HEADER + size);
+      if (!b) {
+	return NULL;
+      }
+      b->size = size;
+    }
+    b->used = 0;
+    b->next = a->head;
+    a->head = b;
+  }
+  p = (char *)b + ARENA_HEADER + b->used;
+  b->used += bytes;
+  memset(p, 0, n * size);
+  return p;
+}
+/* everything allocated after arena_mark() is given back by arena_release() */
+arena_mark_t arena_mark(arena_t *a) {
+  arena_mark_t m = { a->head, a->head ? a->head->used : 0 };
+  return m;
+}
+void arena_release(arena_t *a, arena_mark_t m) {
+  while (a->head != m.block) {
+    arena_block_t *b = a->head;
+    a->head = b->next;
+    arena_block_free(b);
+  }
+  if (a->head) {
+    a->head->used = m.used;
+  }
+}
+/* move the blocks of src to dst */
+void arena_merge(arena_t *dst, arena_t *src) {
+  arena_block_t *b = src->head;
+  if (!b) {
+    return;
+  }
+  while (b->next) {
+    b = b->next;
+  }
+  if (dst->head) {
+    b->next = dst->head->next;
+    dst->head->next = src->head;
+  } else {
+    dst->head = src->head;
+  }
+  src->head = NULL;
+}
+void arena_free(arena_t *a) {
+  arena_mark_t m = { NULL, 0 };
+  arena_release(a, m);
+}
+/* ---------------------------------------------------------------------- */
+/* allocate path objects */
+path_t *path_new(arena_t *a) {
   path_t *p = NULL;
   privpath_t *priv = NULL;
-  SAFE_CALLOC(p, 1, path_t);
-  memset(p, 0, sizeof(path_t));
-  SAFE_CALLOC(priv, 1, privpath_t);
-  memset(priv, 0, sizeof(privpath_t));
+  ARENA_CALLOC(a, p, 1, path_t);
+  ARENA_CALLOC(a, priv, 1, privpath_t);
   p->priv = priv;
   return p;
  calloc_error:
-  free(p);
-  free(priv);
   return NULL;
 }
-/* free the members of the given curve structure. Leave errno unchanged. */
-static void privcurve_free_members(privcurve_t *curve) {
-  free(curve->tag);
-  free(curve->c);
-  free(curve->vertex);
-  free(curve->alpha);
-  free(curve->alpha0);
-  free(curve->beta);
-}
-/* free a path. Leave errno untouched. */
-void path_free(path_t *p) {
-  if (p) {
-    if (p->priv) {
-      free(p->priv->pt);
-      free(p->priv->lon);
-      free(p->priv->sums);
-      free(p->priv->po);
-      privcurve_free_members(&p->priv->curve);
-      privcurve_free_members(&p->priv->ocurve);
-    }
-    free(p->priv);
-    /* do not free p->fcurve ! */
-  }
-  free(p);
-}  
-/* free a pathlist, leaving errno untouched. */
-void pathlist_free(path_t *plist) {
-  path_t *p;
-  list_forall_unlink(p, plist) {
-    path_free(p);
-  }
-}
 /* ---------------------------------------------------------------------- */
-/* initialize and finalize curve structures */
+/* initialize curve structures */
 typedef dpoint_t dpoint3_t[3];
 /* initialize the members of the given curve structure to size m.
    Return 0 on success, 1 on error with errno set. */
-int privcurve_init(privcurve_t *curve, int n) {
+int privcurve_init(privcurve_t *curve, int n, arena_t *a) {
   memset(curve, 0, sizeof(privcurve_t));
   curve->n = n;
-  SAFE_CALLOC(curve->tag, n, int);
-  SAFE_CALLOC(curve->c, n, dpoint3_t);
-  SAFE_CALLOC(curve->vertex, n, dpoint_t);
-  SAFE_CALLOC(curve->alpha, n, double);
-  SAFE_CALLOC(curve->alpha0, n, double);
-  SAFE_CALLOC(curve->beta, n, double);
+  ARENA_CALLOC(a, curve->tag, n, int);
+  ARENA_CALLOC(a, curve->c, n, dpoint3_t);
+  ARENA_CALLOC(a, curve->vertex, n, dpoint_t);
+  ARENA_CALLOC(a, curve->alpha, n, double);
+  ARENA_CALLOC(a, curve->alpha0, n, double);
+  ARENA_CALLOC(a, curve->beta, n, double);
   return 0;
  calloc_error:
-  free(curve->tag);
-  free(curve->c);
-  free(curve->vertex);
-  free(curve->alpha);
-  free(curve->alpha0);
-  free(curve->beta);
   return 1;
 }
 /* copy private to public curve structure */
@@ -650,14 +737,15 @@ static inline void progress_subrange_end(progress_t *prog, progress_t *sub) {
   }    
 }
 #endif /* PROGRESS_H */
-int process_path(path_t *plist, const potrace_param_t *param, progress_t *progress);
+int process_path(path_t *plist, const potrace_param_t *param, arena_t *a, progress_t *progress);
 #endif /* TRACE_H */
 #define INFTY 10000000	/* it suffices that this is longer than any
 			   path; it need not be really infinite */
 #define COS179 -0.999847695156	 /* the cosine of 179 degrees */
 /* ---------------------------------------------------------------------- */
-#define SAFE_CALLOC(var, n, typ) \
-  if ((var = (typ *)calloc(n, sizeof(typ))) == NULL) goto calloc_error 
+/* the stages allocate from the tmp arena of the path, which is emptied
+   after the path; only the curves go to the keep arena */
+#define TMP_CALLOC(var, n, typ) ARENA_CALLOC(pp->mem->tmp, var, n, typ)
 /* ---------------------------------------------------------------------- */
 /* auxiliary functions */
 /* return a direction that is 90 degrees counterclockwise from p2-p0,
@@ -856,7 +944,7 @@ static double tangent(dpoint_t p0, dpoint_t p1, dpoint_t p2, dpoint_t p3, dpoint
 static int calc_sums(privpath_t *pp) {
   int i, x, y;
   int n = pp->len;
-  SAFE_CALLOC(pp->sums, pp->len+1, sums_t);
+  TMP_CALLOC(pp->sums, pp->len+1, sums_t);
   /* origin */
   pp->x0 = pp->pt[0].x;
   pp->y0 = pp->pt[0].y;
@@ -913,8 +1001,8 @@ static int calc_lon(privpath_t *pp) {
   int *nc = NULL;    /* nc[n]: next corner */
   point_t dk;  /* direction of k-k1 */
   int a, b, c, d;
-  SAFE_CALLOC(pivk, n, int);
-  SAFE_CALLOC(nc, n, int);
+  TMP_CALLOC(pivk, n, int);
+  TMP_CALLOC(nc, n, int);
   /* initialize the nc data structure. Point from each point to the
      furthest future point to which it is connected by a vertical or
      horizontal segment. We take advantage of the fact that there is
@@ -929,7 +1017,7 @@ static int calc_lon(privpath_t *pp) {
     }
     nc[i] = k;
   }
-  SAFE_CALLOC(pp->lon, n, int);
+  TMP_CALLOC(pp->lon, n, int);
   /* determine pivot points: for each i, let pivk[i] be the furthest k
      such that all j with i<j<k lie on a line connecting i,k. */
   
@@ -1022,12 +1110,8 @@ static int calc_lon(privpath_t *pp) {
   for (i=n-1; cyclic(mod(i+1,n),j,pp->lon[i]); i--) {
     pp->lon[i] = j;
   }
-  free(pivk);
-  free(nc);
   return 0;
  calloc_error:
-  free(pivk);
-  free(nc);
   return 1;
 }
 /* ---------------------------------------------------------------------- */
@@ -1092,12 +1176,12 @@ static int bestpolygon(privpath_t *pp)
   double thispen;
   double best;
   int c;
-  SAFE_CALLOC(pen, n+1, double);
-  SAFE_CALLOC(prev, n+1, int);
-  SAFE_CALLOC(clip0, n, int);
-  SAFE_CALLOC(clip1, n+1, int);
-  SAFE_CALLOC(seg0, n+1, int);
-  SAFE_CALLOC(seg1, n+1, int);
+  TMP_CALLOC(pen, n+1, double);
+  TMP_CALLOC(prev, n+1, int);
+  TMP_CALLOC(clip0, n, int);
+  TMP_CALLOC(clip1, n+1, int);
+  TMP_CALLOC(seg0, n+1, int);
+  TMP_CALLOC(seg1, n+1, int);
   /* calculate clipped paths */
   for (i=0; i<n; i++) {
     c = mod(pp->lon[mod(i-1,n)]-1,n);
@@ -1153,27 +1237,14 @@ static int bestpolygon(privpath_t *pp)
     }
   }
   pp->m = m;
-  SAFE_CALLOC(pp->po, m, int);
+  TMP_CALLOC(pp->po, m, int);
   /* read off shortest path */
   for (i=n, j=m-1; i>0; j--) {
     i = prev[i];
     pp->po[j] = i;
   }
-  free(pen);
-  free(prev);
-  free(clip0);
-  free(clip1);
-  free(seg0);
-  free(seg1);
   return 0;
-  
  calloc_error:
-  free(pen);
-  free(prev);
-  free(clip0);
-  free(clip1);
-  free(seg0);
-  free(seg1);
   return 1;
 }
 /* ---------------------------------------------------------------------- */
@@ -1197,10 +1268,10 @@ static int adjust_vertices(privpath_t *pp) {
   int i, j, k, l;
   dpoint_t s;
   int r;
-  SAFE_CALLOC(ctr, m, dpoint_t);
-  SAFE_CALLOC(dir, m, dpoint_t);
-  SAFE_CALLOC(q, m, quadform_t);
-  r = privcurve_init(&pp->curve, m);
+  TMP_CALLOC(ctr, m, dpoint_t);
+  TMP_CALLOC(dir, m, dpoint_t);
+  TMP_CALLOC(q, m, quadform_t);
+  r = privcurve_init(&pp->curve, m, pp->mem->keep);
   if (r) {
     goto calloc_error;
   }
@@ -1351,14 +1422,8 @@ static int adjust_vertices(privpath_t *pp) {
     pp->curve.vertex[i].y = ymin + y0;
     continue;
   }
-  free(ctr);
-  free(dir);
-  free(q);
   return 0;
  calloc_error:
-  free(ctr);
-  free(dir);
-  free(q);
   return 1;
 }
 /* ---------------------------------------------------------------------- */
@@ -1554,9 +1619,10 @@ static int opti_penalty(privpath_t *pp, int i, int j, opti_t *res, double opttol
   return 0;
 }
 /* optimize the path p, replacing sequences of Bezier segments by a
-   single segment when possible. Return 0 on success, 1 with errno set
-   on failure. */
-static int opticurve(privpath_t *pp, double opttolerance) {
+   single segment when possible. With window > 0, at most window
+   segments are joined, which bounds the cost on long smooth paths to
+   O(m*window^2). Return 0 on success, 1 with errno set on failure. */
+static int opticurve(privpath_t *pp, double opttolerance, int window) {
   int m = pp->curve.n;
   int *pt = NULL;     /* pt[m+1] */
   double *pen = NULL; /* pen[m+1] */
@@ -1573,12 +1639,12 @@ static int opticurve(privpath_t *pp, double opttolerance) {
   double *t = NULL;
   int *convc = NULL; /* conv[m]: pre-computed convexities */
   double *areac = NULL; /* cumarea[m+1]: cache for fast area computation */
-  SAFE_CALLOC(pt, m+1, int);
-  SAFE_CALLOC(pen, m+1, double);
-  SAFE_CALLOC(len, m+1, int);
-  SAFE_CALLOC(opt, m+1, opti_t);
-  SAFE_CALLOC(convc, m, int);
-  SAFE_CALLOC(areac, m+1, double);
+  TMP_CALLOC(pt, m+1, int);
+  TMP_CALLOC(pen, m+1, double);
+  TMP_CALLOC(len, m+1, int);
+  TMP_CALLOC(opt, m+1, opti_t);
+  TMP_CALLOC(convc, m, int);
+  TMP_CALLOC(areac, m+1, double);
   /* pre-calculate convexity: +1 = right turn, -1 = left turn, 0 = corner */
   for (i=0; i<m; i++) {
     if (pp->curve.tag[i] == POTRACE_CURVETO) {
@@ -1611,6 +1677,10 @@ static int opticurve(privpath_t *pp, double opttolerance) {
     pen[j] = pen[j-1];
     len[j] = len[j-1]+1;
     for (i=j-2; i>=0; i--) {
+      if (window > 0 && j-i > window) {
+	pp->optwindow_hits++;
+	break;
+      }
       r = opti_penalty(pp, i, mod(j,m), &o, opttolerance, convc, areac);
       if (r) {
 	break;
@@ -1624,12 +1694,12 @@ static int opticurve(privpath_t *pp, double opttolerance) {
     }
   }
   om = len[m];
-  r = privcurve_init(&pp->ocurve, om);
+  r = privcurve_init(&pp->ocurve, om, pp->mem->keep);
   if (r) {
     goto calloc_error;
   }
-  SAFE_CALLOC(s, om, double);
-  SAFE_CALLOC(t, om, double);
+  TMP_CALLOC(s, om, double);
+  TMP_CALLOC(t, om, double);
   j = m;
   for (i=om-1; i>=0; i--) {
     if (pt[j]==j-1) {
@@ -1661,30 +1731,86 @@ static int opticurve(privpath_t *pp, double opttolerance) {
     pp->ocurve.beta[i] = s[i] / (s[i] + t[i1]);
   }
   pp->ocurve.alphacurve = 1;
-  free(pt);
-  free(pen);
-  free(len);
-  free(opt);
-  free(s);
-  free(t);
-  free(convc);
-  free(areac);
   return 0;
  calloc_error:
-  free(pt);
-  free(pen);
-  free(len);
-  free(opt);
-  free(s);
-  free(t);
-  free(convc);
-  free(areac);
   return 1;
 }
 /* ---------------------------------------------------------------------- */
 #define TRY(x) if (x) goto try_error
-/* return 0 on success, 1 on error with errno set. */
-int process_path(path_t *plist, const potrace_param_t *param, progress_t *progress) {
+/* curve fitting of one path. Return 0 on success, 1 on error with errno set. */
+static int process_one_path(path_t *p, const potrace_param_t *param, potrace_mem_t *mem) {
+  arena_mark_t m = arena_mark(mem->tmp);
+  p->priv->mem = mem;
+  TRY(calc_sums(p->priv));
+  TRY(calc_lon(p->priv));
+  TRY(bestpolygon(p->priv));
+  TRY(adjust_vertices(p->priv));
+  if (p->sign == '-') {   /* reverse orientation of negative paths */
+    reverse(&p->priv->curve);
+  }
+  smooth(&p->priv->curve, param->alphamax);
+  if (param->opticurve) {
+    TRY(opticurve(p->priv, param->opttolerance, param->optwindow));
+    p->priv->fcurve = &p->priv->ocurve;
+  } else {
+    p->priv->fcurve = &p->priv->curve;
+  }
+  privcurve_to_curve(p->priv->fcurve, &p->curve);
+  p->priv->sums = NULL;  /* only the curves are kept */
+  p->priv->lon = NULL;
+  p->priv->po = NULL;
+  arena_release(mem->tmp, m);
+  return 0;
+ try_error:
+  p->priv->sums = NULL;
+  p->priv->lon = NULL;
+  p->priv->po = NULL;
+  arena_release(mem->tmp, m);
+  return 1;
+}
+
+static int path_len_cmp(const void *a, const void *b) {
+  int la = (*(path_t **)a)->priv->len, lb = (*(path_t **)b)->priv->len;
+  return lb - la;
+}
+
+#define PATH_TASK_LEN 4096  /* points per task when short paths are grouped */
+
+/* fit the n paths of v (largest first) as tasks of the current team, wait for them.
+   Each task allocates from arenas of its own; the results are handed to a at the end. */
+static void process_path_tasks(path_t **v, int n, const potrace_param_t *param, arena_t *a, int *err) {
+  for (int i = 0; i < n; ) {
+    int j = i, len = 0;
+    do {
+      len += v[j++]->priv->len;
+    } while (j < n && len < PATH_TASK_LEN);
+    #pragma omp task firstprivate(i, j)
+    {
+      arena_t keep = { NULL }, tmp = { NULL };
+      potrace_mem_t mem = { &keep, &tmp };
+      for (int k = i; k < j; k++) {
+        if (process_one_path(v[k], param, &mem)) {
+          #pragma omp atomic write
+          *err = 1;
+        }
+      }
+      arena_free(&tmp);
+      #pragma omp critical(potrace_arena)
+      arena_merge(a, &keep);
+    }
+    i = j;
+  }
+  #pragma omp taskwait
+}
+
+/* The paths are independent: they are fitted as OpenMP tasks, largest first, so that
+   a single big layer keeps all threads busy. Short paths are grouped into tasks of
+   about PATH_TASK_LEN points. Inside a parallel region (such as a loop over layers)
+   the tasks go to the threads of that team, otherwise a team is started here. Each
+   path keeps its own result, so the list order and the output do not change. With a
+   progress callback the paths are fitted in list order on the calling thread.
+   The curves are allocated from a. Return 0 on success, 1 on error with errno set. */
+int process_path(path_t *plist, const potrace_param_t *param, arena_t *a, progress_t *progress) {
   path_t *p;
   double nn = 0, cn = 0;
   if (progress->callback) {
@@ -1694,34 +1820,52 @@ int process_path(path_t *plist, const potrace_param_t *param, progress_t *progre
       nn += p->priv->len;
     }
     cn = 0;
-  }
-  
-  /* call downstream function with each path */
-  list_forall (p, plist) {
-    TRY(calc_sums(p->priv));
-    TRY(calc_lon(p->priv));
-    TRY(bestpolygon(p->priv));
-    TRY(adjust_vertices(p->priv));
-    if (p->sign == '-') {   /* reverse orientation of negative paths */
-      reverse(&p->priv->curve);
-    }
-    smooth(&p->priv->curve, param->alphamax);
-    if (param->opticurve) {
-      TRY(opticurve(p->priv, param->opttolerance));
-      p->priv->fcurve = &p->priv->ocurve;
-    } else {
-      p->priv->fcurve = &p->priv->curve;
-    }
-    privcurve_to_curve(p->priv->fcurve, &p->curve);
-    if (progress->callback) {
+    
+    /* call downstream function with each path */
+    arena_t tmp = { NULL };
+    potrace_mem_t mem = { a, &tmp };
+    list_forall (p, plist) {
+      if (process_one_path(p, param, &mem)) {
+        arena_free(&tmp);
+        return 1;
+      }
       cn += p->priv->len;
       progress_update(cn/nn, progress);
     }
+    arena_free(&tmp);
+    progress_update(1.0, progress);
+    return 0;
+  }
+
+  int n = 0, err = 0;
+  list_forall (p, plist) {
+    n++;
+  }
+  if (n == 0) {  /* malloc(0) may return NULL */
+    progress_update(1.0, progress);
+    return 0;
+  }
+  path_t **v = (path_t **)malloc(n * sizeof(path_t *));
+  if (!v) {
+    return 1;
   }
+  n = 0;
+  list_forall (p, plist) {
+    v[n++] = p;
+  }
+  qsort(v, n, sizeof(path_t *), path_len_cmp);
+
+#ifdef _OPENMP
+  if (!omp_in_parallel()) {
+    #pragma omp parallel
+    #pragma omp single
+    process_path_tasks(v, n, param, a, &err);
+  } else
+#endif
+  process_path_tasks(v, n, param, a, &err);
+  free(v);
   progress_update(1.0, progress);
-  return 0;
- try_error:
-  return 1;
+  return err;
 }
 /* Copyright (C) 2001-2019 Peter Selinger.
    This file is part of Potrace. It is free software and it is covered
@@ -1933,7 +2077,8 @@ static inline int bm_resize(potrace_bitmap_t *bm, int h) {
    by the GNU General Public License. See the file COPYING for details. */
 #ifndef DECOMPOSE_H
 #define DECOMPOSE_H
-int bm_to_pathlist(const potrace_bitmap_t *bm, path_t **plistp, const potrace_param_t *param, progress_t *progress);
+int bm_to_pathlist(const potrace_bitmap_t *bm, path_t **plistp, const potrace_param_t *param, arena_t *a, progress_t *progress);
+int lm_to_pathlists(const unsigned char *map, int w, int h, int n, const unsigned char *trace, path_t **plist, const potrace_param_t *param, arena_t *a);
 #endif /* DECOMPOSE_H */
 /* ---------------------------------------------------------------------- */
 /* deterministically and efficiently hash (x,y) into a pseudo-random bit */
@@ -1982,11 +2127,12 @@ typedef struct bbox_s bbox_t;
 static void clear_bm_with_bbox(potrace_bitmap_t *bm, bbox_t *bbox) {
   int imin = (bbox->x0 / BM_WORDBITS);
   int imax = ((bbox->x1 + BM_WORDBITS-1) / BM_WORDBITS);
-  int i, y;
+  int y;
+  if (imax <= imin) {
+    return;
+  }
   for (y=bbox->y0; y<bbox->y1; y++) {
-    for (i=imin; i<imax; i++) {
-      bm_scanline(bm, y)[i] = 0;
-    }
+    memset(bm_scanline(bm, y) + imin, 0, (size_t)(imax-imin) * BM_WORDSIZE);
   }
 }
 /* ---------------------------------------------------------------------- */
@@ -2013,6 +2159,20 @@ static int majority(potrace_bitmap_t *bm, int x, int y) {
 }
 /* ---------------------------------------------------------------------- */
 /* decompose image into paths */
+/* number of leading zero bits of a non-zero word, i.e. the offset of
+   its first pixel */
+static inline int bm_clz(potrace_word w) {
+#ifdef __GNUC__
+  return __builtin_clzl(w);
+#else
+  int n = 0;
+  while (!(w & BM_HIBIT)) {
+    w <<= 1;
+    n++;
+  }
+  return n;
+#endif
+}
 /* efficiently invert bits [x,infty) and [xa,infty) in line y. Here xa
    must be a multiple of BM_WORDBITS. */
 static void xor_to_ref(potrace_bitmap_t *bm, int x, int y, int xa) {
@@ -2091,7 +2251,7 @@ static void setbbox_path(bbox_t *bbox, path_t *p) {
    new path_t object, or NULL on error (note that a legitimate path
    cannot have length 0). Sign is required for correct interpretation
    of turnpolicies. */
-static path_t *findpath(potrace_bitmap_t *bm, int x0, int y0, int sign, int turnpolicy) {
+static path_t *findpath(potrace_bitmap_t *bm, int x0, int y0, int sign, int turnpolicy, arena_t *a, point_t **buf, int *bufsize) {
   int x, y, dirx, diry, len, size;
   uint64_t area;
   int c, d, tmp;
@@ -2101,8 +2261,9 @@ static path_t *findpath(potrace_bitmap_t *bm, int x0, int y0, int sign, int turn
   y = y0;
   dirx = 0;
   diry = -1;
-  len = size = 0;
-  pt = NULL;
+  len = 0;
+  size = *bufsize;
+  pt = *buf;
   area = 0;
   
   while (1) {
@@ -2112,9 +2273,10 @@ static path_t *findpath(potrace_bitmap_t *bm, int x0, int y0, int sign, int turn
       size = (int)(1.3 * size);
       pt1 = (point_t *)realloc(pt, size * sizeof(point_t));
       if (!pt1) {
-	goto error;
+	return NULL;
       }
-      pt = pt1;
+      *buf = pt = pt1;
+      *bufsize = size;
     }
     pt[len].x = x;
     pt[len].y = y;
@@ -2159,20 +2321,21 @@ static path_t *findpath(potrace_bitmap_t *bm, int x0, int y0, int sign, int turn
       diry = tmp;
     }
   } /* while this path */
-  /* allocate new path object */
-  p = path_new();
+  /* allocate new path object; the points are copied out of the
+     scratch buffer */
+  p = path_new(a);
   if (!p) {
-    goto error;
+    return NULL;
+  }
+  p->priv->pt = (point_t *)arena_calloc(a, len, sizeof(point_t));
+  if (!p->priv->pt) {
+    return NULL;
   }
-  p->priv->pt = pt;
+  memcpy(p->priv->pt, pt, len * sizeof(point_t));
   p->priv->len = len;
   p->area = area <= INT_MAX ? area : INT_MAX; /* avoid overflow */
   p->sign = sign;
   return p;
- 
- error:
-   free(pt);
-   return NULL; 
 }
 /* Give a tree structure to the given path list, based on "insideness"
    testing. I.e., path A is considered "below" path B if it is inside
@@ -2187,8 +2350,9 @@ static path_t *findpath(potrace_bitmap_t *bm, int x0, int y0, int sign, int turn
    corner of the path, as returned by bm_to_pathlist. This makes it
    easy to find an "interior" point. The bm argument should be a
    bitmap of the correct size (large enough to hold all the paths),
-   and will be used as scratch space. Return 0 on success or -1 on
-   error with errno set. */
+   and will be used as scratch space; it must be clear, as it is left
+   by the decomposition. Each path only touches the words of its
+   bounding box. */
 static void pathlist_to_tree(path_t *plist, potrace_bitmap_t *bm) {
   path_t *p, *p1;
   path_t *heap, *heap1;
@@ -2198,7 +2362,6 @@ static void pathlist_to_tree(path_t *plist, potrace_bitmap_t *bm) {
   path_t **hook_in, **hook_out; /* for fast appending to linked list */
   bbox_t bbox;
   
-  bm_clear(bm, 0);
   /* save original "next" pointers */
   list_forall(p, plist) {
     p->sibling = p->next;
@@ -2300,25 +2463,24 @@ static void pathlist_to_tree(path_t *plist, potrace_bitmap_t *bm) {
    left-to-right, then top-down. In other words, (x,y)<(x',y') if y>y'
    or y=y' and x<x'. If found, return 0 and store pixel in
    (*xp,*yp). Else return 1. Note that this function assumes that
-   excess bytes have been cleared with bm_clearexcess. */
+   excess bytes have been cleared with bm_clearexcess. Empty words
+   are skipped, the pixel is then located with bm_clz. */
 static int findnext(potrace_bitmap_t *bm, int *xp, int *yp) {
-  int x;
-  int y;
-  int x0;
-  x0 = (*xp) & ~(BM_WORDBITS-1);
+  int i, y;
+  int n = (bm->w + BM_WORDBITS-1) / BM_WORDBITS;
+  potrace_word *line;
+  i = *xp / BM_WORDBITS;
   for (y=*yp; y>=0; y--) {
-    for (x=x0; x<bm->w && x>=0; x+=(unsigned)BM_WORDBITS) {
-      if (*bm_index(bm, x, y)) {
-	while (!BM_GET(bm, x, y)) {
-	  x++;
-	}
+    line = bm_scanline(bm, y);
+    for (; i<n; i++) {
+      if (line[i]) {
 	/* found */
-	*xp = x;
+	*xp = i*BM_WORDBITS + bm_clz(line[i]);
 	*yp = y;
 	return 0;
       }
     }
-    x0 = 0;
+    i = 0;
   }
   /* not found */
   return 1;
@@ -2327,7 +2489,7 @@ static int findnext(potrace_bitmap_t *bm, int *xp, int *yp) {
    path_t objects with the fields len, pt, area, sign filled
    in. Returns 0 on success with plistp set, or -1 on error with errno
    set. */
-int bm_to_pathlist(const potrace_bitmap_t *bm, path_t **plistp, const potrace_param_t *param, progress_t *progress) {
+int bm_to_pathlist(const potrace_bitmap_t *bm, path_t **plistp, const potrace_param_t *param, arena_t *a, progress_t *progress) {
   int x;
   int y;
   path_t *p;
@@ -2335,6 +2497,9 @@ int bm_to_pathlist(const potrace_bitmap_t *bm, path_t **plistp, const potrace_pa
   path_t **plist_hook = &plist;  /* used to speed up appending to linked list */
   potrace_bitmap_t *bm1 = NULL;
   int sign;
+  point_t *buf = NULL;  /* scratch points of findpath */
+  int bufsize = 0;
+  arena_mark_t start = arena_mark(a), m;
   bm1 = bm_dup(bm);
   if (!bm1) {
     goto error;
@@ -2349,7 +2514,8 @@ int bm_to_pathlist(const potrace_bitmap_t *bm, path_t **plistp, const potrace_pa
     /* calculate the sign by looking at the original */
     sign = BM_GET(bm, x, y) ? '+' : '-';
     /* calculate the path */
-    p = findpath(bm1, x, y+1, sign, param->turnpolicy);
+    m = arena_mark(a);
+    p = findpath(bm1, x, y+1, sign, param->turnpolicy, a, &buf, &bufsize);
     if (p==NULL) {
       goto error;
     }
@@ -2357,7 +2523,7 @@ int bm_to_pathlist(const potrace_bitmap_t *bm, path_t **plistp, const potrace_pa
     xor_path(bm1, p);
     /* if it's a turd, eliminate it, else append it to the list */
     if (p->area <= param->turdsize) {
-      path_free(p);
+      arena_release(a, m);
     } else {
       list_insert_beforehook(p, plist_hook);
     }
@@ -2367,14 +2533,261 @@ int bm_to_pathlist(const potrace_bitmap_t *bm, path_t **plistp, const potrace_pa
   }
   pathlist_to_tree(plist, bm1);
   bm_free(bm1);
+  free(buf);
   *plistp = plist;
   progress_update(1.0, progress);
   return 0;
  error:
   bm_free(bm1);
-  list_forall_unlink(p, plist) {
-    path_free(p);
+  free(buf);
+  arena_release(a, start);
+  return -1;
+}
+/* ---------------------------------------------------------------------- */
+/* decompose a label map into the paths of all labels in one scan */
+/* A label map has one label per pixel, rows top down. Pixel (x,y) is
+   counted from the bottom, like in a bitmap; outside the map the label
+   is -1. The paths of label c are the same as those of the bitmap of
+   the pixels with label c, except that the turn policy only looks at
+   the map, not at a bitmap modified by earlier paths. */
+struct labelmap_s {
+  const unsigned char *map;
+  int w, h;
+  unsigned char *mark;  /* per pixel: LM_TOP / LM_BOTTOM edge is on a path of its label */
+};
+typedef struct labelmap_s labelmap_t;
+#define LM_TOP 1
+#define LM_BOTTOM 2
+static inline int lm_get(const labelmap_t *lm, int x, int y) {
+  if (x < 0 || x >= lm->w || y < 0 || y >= lm->h) {
+    return -1;
+  }
+  return lm->map[(ptrdiff_t)(lm->h-1-y) * lm->w + x];
+}
+/* is (x,y) inside a path of label c? For negative paths the inside is
+   the hole. */
+#define LM_IN(lm, x, y, c, neg) ((lm_get(lm, x, y) == (c)) != (neg))
+/* majority() on the pixels of label c */
+static int lm_majority(const labelmap_t *lm, int x, int y, int c) {
+  int i, a, ct;
+  for (i=2; i<5; i++) { /* check at "radius" i */
+    ct = 0;
+    for (a=-i+1; a<=i-1; a++) {
+      ct += lm_get(lm, x+a, y+i-1) == c ? 1 : -1;
+      ct += lm_get(lm, x+i-1, y+a-1) == c ? 1 : -1;
+      ct += lm_get(lm, x+a-1, y-i) == c ? 1 : -1;
+      ct += lm_get(lm, x-i, y+a) == c ? 1 : -1;
+    }
+    if (ct>0) {
+      return 1;
+    } else if (ct<0) {
+      return 0;
+    }
+  }
+  return 0;
+}
+/* are the two pixels of label c that meet diagonally at (x,y) joined?
+   This is the right turn of a positive path in findpath(). Both paths
+   through the corner must agree, so negative paths use the same
+   answer. */
+static int lm_joined(const labelmap_t *lm, int x, int y, int c, int turnpolicy) {
+  switch (turnpolicy) {
+  case POTRACE_TURNPOLICY_BLACK:
+  case POTRACE_TURNPOLICY_RIGHT:
+    return 1;
+  case POTRACE_TURNPOLICY_RANDOM:
+    return detrand(x,y);
+  case POTRACE_TURNPOLICY_MAJORITY:
+    return lm_majority(lm, x, y, c);
+  case POTRACE_TURNPOLICY_MINORITY:
+    return !lm_majority(lm, x, y, c);
+  }
+  return 0;
+}
+/* findpath() for label c of the map, marking the horizontal edges it
+   passes. Return the area enclosed by the path, the points are in
+   (*buf)[0..*len-1], or -1 on error with errno set. */
+static int64_t lm_findpath(labelmap_t *lm, int x0, int y0, int c, int neg, int turnpolicy, point_t **buf, int *bufsize, int *lenp) {
+  int x, y, dirx, diry, len, size;
+  int64_t area;
+  int in1, in2, tmp;
+  point_t *pt, *pt1;
+  x = x0;
+  y = y0;
+  dirx = 0;
+  diry = -1;
+  len = 0;
+  size = *bufsize;
+  pt = *buf;
+  area = 0;
+  
+  while (1) {
+    /* add point to path */
+    if (len>=size) {
+      size += 100;
+      size = (int)(1.3 * size);
+      pt1 = (point_t *)realloc(pt, size * sizeof(point_t));
+      if (!pt1) {
+	return -1;
+      }
+      *buf = pt = pt1;
+      *bufsize = size;
+    }
+    pt[len].x = x;
+    pt[len].y = y;
+    len++;
+    
+    /* mark the edge on the side of label c */
+    if (dirx > 0) {
+      if (neg) {
+	lm->mark[(ptrdiff_t)(lm->h-y) * lm->w + x] |= LM_TOP;
+      } else {
+	lm->mark[(ptrdiff_t)(lm->h-1-y) * lm->w + x] |= LM_BOTTOM;
+      }
+    } else if (dirx < 0) {
+      if (neg) {
+	lm->mark[(ptrdiff_t)(lm->h-1-y) * lm->w + x-1] |= LM_BOTTOM;
+      } else {
+	lm->mark[(ptrdiff_t)(lm->h-y) * lm->w + x-1] |= LM_TOP;
+      }
+    }
+    
+    /* move to next point */
+    x += dirx;
+    y += diry;
+    area += x*diry;
+    
+    /* path complete? */
+    if (x==x0 && y==y0) {
+      break;
+    }
+    
+    /* determine next direction */
+    in1 = LM_IN(lm, x + (dirx+diry-1)/2, y + (diry-dirx-1)/2, c, neg);
+    in2 = LM_IN(lm, x + (dirx-diry-1)/2, y + (diry+dirx-1)/2, c, neg);
+    
+    if (in1 && !in2) {           /* ambiguous turn */
+      if (lm_joined(lm, x, y, c, turnpolicy) != neg) {
+	tmp = dirx;              /* right turn */
+	dirx = diry;
+	diry = -tmp;
+      } else {
+	tmp = dirx;              /* left turn */
+	dirx = -diry;
+	diry = tmp;
+      }
+    } else if (in1) {            /* right turn */
+      tmp = dirx;
+      dirx = diry;
+      diry = -tmp;
+    } else if (!in2) {           /* left turn */
+      tmp = dirx;
+      dirx = -diry;
+      diry = tmp;
+    }
+  } /* while this path */
+  *lenp = len;
+  return area;
+}
+/* Decompose the w*h label map into the paths of each label c < n with
+   trace[c] set: plist[c] gets them in the order and tree structure of
+   bm_to_pathlist(), allocated from a[c]. A path starts at the first
+   horizontal edge met by a top down scan, which is where findnext()
+   finds it; the edge marks replace the xor-ed bitmap. Each edge is
+   walked once for the label on either side. Return 0 on success or -1
+   on error with errno set. */
+int lm_to_pathlists(const unsigned char *map, int w, int h, int n, const unsigned char *trace, path_t **plist, const potrace_param_t *param, arena_t *a) {
+  labelmap_t lm = { map, w, h, NULL };
+  path_t ***hook = NULL;  /* for fast appending to the lists */
+  potrace_bitmap_t *bm = NULL;
+  point_t *buf = NULL;  /* scratch points of lm_findpath */
+  int bufsize = 0;
+  int x, y, c, k, len;
+  int64_t area;
+  path_t *p;
+  
+  hook = (path_t ***)malloc(n * sizeof(path_t **));
+  lm.mark = (unsigned char *)calloc((size_t)w * h, 1);
+  if (!hook || !lm.mark) {
+    goto error;
   }
+  for (c=0; c<n; c++) {
+    plist[c] = NULL;
+    hook[c] = &plist[c];
+  }
+  for (y=h-1; y>=0; y--) {
+    const unsigned char *row = map + (ptrdiff_t)(h-1-y) * w;
+    unsigned char *mrow = lm.mark + (ptrdiff_t)(h-1-y) * w;
+    for (x=0; x<w; x++) {
+      int lab[2];
+      if (y<h-1) {
+	/* skip runs of 8 labels that equal the row above */
+	uint64_t u, v;
+	while ((x & 7) == 0 && x+8 <= w) {
+	  memcpy(&u, row+x, 8);
+	  memcpy(&v, row+x-w, 8);
+	  if (u != v) {
+	    break;
+	  }
+	  x += 8;
+	}
+	if (x >= w) {
+	  break;
+	}
+      }
+      lab[0] = row[x];  /* below and above the edge */
+      lab[1] = y<h-1 ? row[x-w] : -1;
+      if (lab[0] == lab[1]) {
+	continue;
+      }
+      for (k=0; k<2; k++) {
+	c = lab[k];
+	if (c < 0 || c >= n || (trace && !trace[c])) {
+	  continue;
+	}
+	if (k ? (mrow[x-w] & LM_BOTTOM) : (mrow[x] & LM_TOP)) {
+	  continue;
+	}
+	area = lm_findpath(&lm, x, y+1, c, k, param->turnpolicy, &buf, &bufsize, &len);
+	if (area < 0) {
+	  goto error;
+	}
+	if (area <= param->turdsize) {
+	  continue;
+	}
+	p = path_new(&a[c]);
+	if (!p || !(p->priv->pt = (point_t *)arena_calloc(&a[c], len, sizeof(point_t)))) {
+	  goto error;
+	}
+	memcpy(p->priv->pt, buf, len * sizeof(point_t));
+	p->priv->len = len;
+	p->area = area <= INT_MAX ? area : INT_MAX; /* avoid overflow */
+	p->sign = k ? '-' : '+';
+	list_insert_beforehook(p, hook[c]);
+      }
+    }
+  }
+  free(lm.mark);
+  lm.mark = NULL;
+  free(buf);
+  buf = NULL;
+  
+  /* one scratch bitmap for all trees; each leaves it clear */
+  bm = bm_new(w, h);
+  if (!bm) {
+    goto error;
+  }
+  for (c=0; c<n; c++) {
+    pathlist_to_tree(plist[c], bm);
+  }
+  bm_free(bm);
+  free(hook);
+  return 0;
+  
+ error:
+  free(lm.mark);
+  free(buf);
+  free(hook);
   return -1;
 }
 /* Copyright (C) 2001-2019 Peter Selinger.
@@ -2389,6 +2802,7 @@ static const potrace_param_t param_default = {
   1.0,                           /* alphamax */
   1,                             /* opticurve */
   0.2,                           /* opttolerance */
+  0,                             /* optwindow */
   {
     NULL,                        /* callback function */
     NULL,                        /* callback data */
@@ -2414,7 +2828,22 @@ potrace_param_t *potrace_param_default(void) {
    set). Complete or incomplete Potrace state can be freed with
    potrace_state_free(). */
 potrace_state_t *potrace_trace(const potrace_param_t *param, const potrace_bitmap_t *bm) {
-  int r;
+  return potrace_trace_at(param, bm, 0, 0);
+}
+/* monotonic time in seconds, for the stage times of a state */
+static double potrace_clock(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+/* Same as potrace_trace, but for a bitmap cropped out of a larger one
+   at (x0,y0). The decomposed paths are moved to the coordinates of the
+   larger bitmap before curve fitting, so the result is the same as if
+   the larger bitmap had been traced. */
+potrace_state_t *potrace_trace_at(const potrace_param_t *param, const potrace_bitmap_t *bm, int x0, int y0) {
+  int r, k;
+  double t;
+  path_t *p;
   path_t *plist = NULL;
   potrace_state_t *st;
   progress_t prog;
@@ -2432,29 +2861,126 @@ potrace_state_t *potrace_trace(const potrace_param_t *param, const potrace_bitma
   if (!st) {
     return NULL;
   }
+  st->priv = (struct potrace_privstate_s *)calloc(1, sizeof(struct potrace_privstate_s));
+  if (!st->priv) {
+    free(st);
+    return NULL;
+  }
   progress_subrange_start(0.0, 0.1, &prog, &subprog);
   /* process the image */
-  r = bm_to_pathlist(bm, &plist, param, &subprog);
+  t = potrace_clock();
+  r = bm_to_pathlist(bm, &plist, param, &st->priv->arena, &subprog);
   if (r) {
+    free(st->priv);
     free(st);
     return NULL;
   }
+  if (x0 || y0) {
+    list_forall (p, plist) {
+      for (k=0; k<p->priv->len; k++) {
+	p->priv->pt[k].x += x0;
+	p->priv->pt[k].y += y0;
+      }
+    }
+  }
   st->status = POTRACE_STATUS_OK;
   st->plist = plist;
-  st->priv = NULL;  /* private state currently unused */
+  st->time[0] = potrace_clock() - t;
   progress_subrange_end(&prog, &subprog);
   progress_subrange_start(0.1, 1.0, &prog, &subprog);
   /* partial success. */
-  r = process_path(plist, param, &subprog);
+  t = potrace_clock();
+  r = process_path(plist, param, &st->priv->arena, &subprog);
   if (r) {
     st->status = POTRACE_STATUS_INCOMPLETE;
   }
+  st->time[1] = potrace_clock() - t;
+  st->optwindow_hits = 0;
+  list_forall (p, plist) {
+    st->optwindow_hits += p->priv->optwindow_hits;
+  }
   progress_subrange_end(&prog, &subprog);
   return st;
 }
+/* Trace each label c < n of the w*h label map with trace[c] set, or
+   every label if trace is NULL. st[c] gets the state that
+   potrace_trace() gives for the bitmap of label c, the others are
+   NULL. The labels are decomposed together in one scan of the map;
+   this time is shared among the states by their number of path
+   points. Return 0 on success, or -1 with errno set. The states in st
+   are freed with potrace_state_free() either way. */
+int potrace_trace_labels(const potrace_param_t *param, const unsigned char *map, int w, int h, int n, const unsigned char *trace, potrace_state_t **st) {
+  int c, r;
+  double t, len, total = 0;
+  path_t *p;
+  path_t **plist = NULL;
+  arena_t *a = NULL;
+  progress_t prog;
+  memset(&prog, 0, sizeof(prog));  /* no progress callback */
+  for (c=0; c<n; c++) {
+    st[c] = NULL;
+  }
+  plist = (path_t **)calloc(n, sizeof(path_t *));
+  a = (arena_t *)calloc(n, sizeof(arena_t));
+  if (!plist || !a) {
+    goto error;
+  }
+  t = potrace_clock();
+  r = lm_to_pathlists(map, w, h, n, trace, plist, param, a);
+  if (r) {
+    goto error;
+  }
+  t = potrace_clock() - t;
+  for (c=0; c<n; c++) {
+    list_forall (p, plist[c]) {
+      total += p->priv->len;
+    }
+  }
+  for (c=0; c<n; c++) {
+    if (trace && !trace[c]) {
+      continue;
+    }
+    st[c] = (potrace_state_t *)malloc(sizeof(potrace_state_t));
+    if (!st[c] || !(st[c]->priv = (struct potrace_privstate_s *)calloc(1, sizeof(struct potrace_privstate_s)))) {
+      free(st[c]);
+      st[c] = NULL;
+      goto error;
+    }
+    st[c]->priv->arena = a[c];
+    a[c].head = NULL;  /* now owned by the state */
+    st[c]->status = POTRACE_STATUS_OK;
+    st[c]->plist = plist[c];
+    len = 0;
+    list_forall (p, plist[c]) {
+      len += p->priv->len;
+    }
+    st[c]->time[0] = total > 0 ? t * len / total : 0;
+    st[c]->time[1] = potrace_clock();
+    r = process_path(plist[c], param, &st[c]->priv->arena, &prog);
+    if (r) {
+      st[c]->status = POTRACE_STATUS_INCOMPLETE;
+    }
+    st[c]->time[1] = potrace_clock() - st[c]->time[1];
+    st[c]->optwindow_hits = 0;
+    list_forall (p, plist[c]) {
+      st[c]->optwindow_hits += p->priv->optwindow_hits;
+    }
+  }
+  free(plist);
+  free(a);
+  return 0;
+ error:
+  for (c=0; a && c<n; c++) {
+    arena_free(&a[c]);
+  }
+  free(plist);
+  free(a);
+  return -1;
+}
 /* free a Potrace state, without disturbing errno. */
 void potrace_state_free(potrace_state_t *st) {
-  pathlist_free(st->plist);
+  arena_free(&st->priv->arena);
+  free(st->priv);
   free(st);
 }
 /* free a parameter list, without disturbing errno. */